@@ -0,0 +1,486 @@
+/*
+allocator benchmarks, every workload run once against glibc's malloc and once
+with the library preloaded, side by side
+
+make bench
+./bench/bench ./libmalloc.so [workload...]
+
+each run is a fresh process, so peak RSS is per workload and allocator
+*/
+
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#define NUM_THREADS 4
+#define LATENCY_SAMPLES (1 << 20) // per run, every LATENCY_STRIDE-th op is timed
+#define LATENCY_STRIDE 16
+
+typedef struct {
+    uint64_t ops;
+    double seconds;
+    uint64_t* latencies; // ns
+    size_t num_latencies;
+    pthread_mutex_t lock;
+} result_t;
+
+static result_t result;
+
+static uint64_t now_ns() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t next_random(uint64_t* state) {
+    uint64_t x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+// per-thread latency samples, merged into result when the thread is done
+typedef struct {
+    uint64_t samples[LATENCY_SAMPLES / NUM_THREADS];
+    size_t count;
+    uint64_t ops;
+} recorder_t;
+
+static void record(recorder_t* rec, uint64_t start) {
+    if (rec->count < sizeof(rec->samples) / sizeof(rec->samples[0])) {
+        rec->samples[rec->count++] = now_ns() - start;
+    }
+}
+
+static void merge(recorder_t* rec) {
+    pthread_mutex_lock(&result.lock);
+    memcpy(result.latencies + result.num_latencies, rec->samples, rec->count * sizeof(uint64_t));
+    result.num_latencies += rec->count;
+    result.ops += rec->ops;
+    pthread_mutex_unlock(&result.lock);
+}
+
+// malloc and free of one size, timing one pair in LATENCY_STRIDE
+static void bench_size(size_t size, uint64_t ops) {
+    static recorder_t rec;
+    void* blocks[64];
+    uint64_t i, start;
+    int j;
+
+    for (i = 0; i < ops; i += 64) {
+        if ((i / 64) % LATENCY_STRIDE == 0) {
+            start = now_ns();
+            blocks[0] = malloc(size);
+            *(volatile char*)blocks[0] = 1;
+            free(blocks[0]);
+            record(&rec, start);
+        }
+        for (j = 0; j < 64; j++) {
+            blocks[j] = malloc(size);
+            *(volatile char*)blocks[j] = 1;
+        }
+        for (j = 0; j < 64; j++) {
+            free(blocks[j]);
+        }
+    }
+    rec.ops = ops;
+    merge(&rec);
+}
+
+// producers allocate into a ring, consumers on other threads free
+#define RING_SIZE 1024
+
+typedef struct {
+    void* slots[RING_SIZE];
+    size_t head, tail;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    int done;
+    recorder_t rec;
+} ring_t;
+
+static void* producer(void* arg) {
+    ring_t* ring = arg;
+    uint64_t seed = (uintptr_t)arg | 1, start;
+    void* batch[64];
+    int i, n;
+
+    for (n = 0; n < 4000; n++) {
+        for (i = 0; i < 64; i++) {
+            start = now_ns();
+            batch[i] = malloc(16 + next_random(&seed) % 496);
+            if (i == 0) {
+                record(&ring->rec, start);
+            }
+            *(volatile char*)batch[i] = 1;
+        }
+        pthread_mutex_lock(&ring->lock);
+        while (ring->head - ring->tail > RING_SIZE - 64) {
+            pthread_cond_wait(&ring->changed, &ring->lock);
+        }
+        for (i = 0; i < 64; i++) {
+            ring->slots[ring->head++ % RING_SIZE] = batch[i];
+        }
+        pthread_cond_broadcast(&ring->changed);
+        pthread_mutex_unlock(&ring->lock);
+        ring->rec.ops += 64;
+    }
+    pthread_mutex_lock(&ring->lock);
+    ring->done = 1;
+    pthread_cond_broadcast(&ring->changed);
+    pthread_mutex_unlock(&ring->lock);
+    return NULL;
+}
+
+static void* consumer(void* arg) {
+    ring_t* ring = arg;
+    void* batch[RING_SIZE];
+    size_t i, n;
+
+    for (;;) {
+        pthread_mutex_lock(&ring->lock);
+        while (ring->head == ring->tail && !ring->done) {
+            pthread_cond_wait(&ring->changed, &ring->lock);
+        }
+        for (n = 0; ring->tail != ring->head; n++) {
+            batch[n] = ring->slots[ring->tail++ % RING_SIZE];
+        }
+        pthread_cond_broadcast(&ring->changed);
+        if (!n && ring->done) {
+            pthread_mutex_unlock(&ring->lock);
+            return NULL;
+        }
+        pthread_mutex_unlock(&ring->lock);
+        for (i = 0; i < n; i++) {
+            free(batch[i]);
+        }
+    }
+}
+
+static void bench_producer_consumer() {
+    static ring_t rings[NUM_THREADS / 2];
+    pthread_t threads[NUM_THREADS];
+    int i;
+
+    for (i = 0; i < NUM_THREADS / 2; i++) {
+        pthread_mutex_init(&rings[i].lock, NULL);
+        pthread_cond_init(&rings[i].changed, NULL);
+        pthread_create(&threads[2 * i], NULL, producer, &rings[i]);
+        pthread_create(&threads[2 * i + 1], NULL, consumer, &rings[i]);
+    }
+    for (i = 0; i < NUM_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    for (i = 0; i < NUM_THREADS / 2; i++) {
+        merge(&rings[i].rec);
+    }
+}
+
+// larson: each thread replaces random slots with random-sized blocks, and in
+// every round hands its slots to the next thread, which frees them
+#define LARSON_SLOTS 1000
+#define LARSON_ROUNDS 20
+
+typedef struct {
+    int id;
+    recorder_t rec;
+} larson_t;
+
+static void* larson_slots[NUM_THREADS][LARSON_SLOTS];
+static pthread_barrier_t larson_barrier;
+
+static void* larson(void* arg) {
+    larson_t* self = arg;
+    uint64_t seed = 0x9e3779b97f4a7c15ULL * (self->id + 1), start;
+    void** slots;
+    int round, i, slot;
+
+    for (round = 0; round < LARSON_ROUNDS; round++) {
+        slots = larson_slots[(self->id + round) % NUM_THREADS];
+        for (i = 0; i < 20000; i++) {
+            slot = next_random(&seed) % LARSON_SLOTS;
+            start = now_ns();
+            free(slots[slot]);
+            slots[slot] = malloc(8 + next_random(&seed) % 1000);
+            if (i % LATENCY_STRIDE == 0) {
+                record(&self->rec, start);
+            }
+            *(volatile char*)slots[slot] = 1;
+        }
+        self->rec.ops += 20000;
+        pthread_barrier_wait(&larson_barrier);
+    }
+    return NULL;
+}
+
+static void bench_larson() {
+    static larson_t threads[NUM_THREADS];
+    pthread_t ids[NUM_THREADS];
+    int i, j;
+
+    pthread_barrier_init(&larson_barrier, NULL, NUM_THREADS);
+    for (i = 0; i < NUM_THREADS; i++) {
+        threads[i].id = i;
+        pthread_create(&ids[i], NULL, larson, &threads[i]);
+    }
+    for (i = 0; i < NUM_THREADS; i++) {
+        pthread_join(ids[i], NULL);
+        merge(&threads[i].rec);
+    }
+    for (i = 0; i < NUM_THREADS; i++) {
+        for (j = 0; j < LARSON_SLOTS; j++) {
+            free(larson_slots[i][j]);
+        }
+    }
+}
+
+// grow buffers by realloc in small steps, as string builders do
+static void bench_realloc() {
+    static recorder_t rec;
+    uint64_t start;
+    size_t size;
+    char* buf;
+    int i;
+
+    for (i = 0; i < 200; i++) {
+        buf = NULL;
+        for (size = 64; size <= 1 << 20; size += size / 8 + 16) {
+            start = now_ns();
+            buf = realloc(buf, size);
+            record(&rec, start);
+            buf[size - 1] = 1;
+            rec.ops++;
+        }
+        free(buf);
+    }
+    merge(&rec);
+}
+
+static size_t current_rss() {
+    long pages = 0;
+    FILE* statm = fopen("/proc/self/statm", "r");
+
+    if (statm) {
+        if (fscanf(statm, "%*s %ld", &pages) != 1) {
+            pages = 0;
+        }
+        fclose(statm);
+    }
+    return pages * sysconf(_SC_PAGESIZE);
+}
+
+// fill the heap with small blocks, free most of them at random, allocate
+// larger ones into the gaps and free most again, printing the RSS after every
+// phase: memory that does not come back shows up as fragmentation
+#define FRAG_BLOCKS 400000
+
+static void bench_fragmentation() {
+    static void* blocks[FRAG_BLOCKS];
+    static recorder_t rec;
+    uint64_t seed = 42, start;
+    int phase, i;
+
+    for (phase = 0; phase < 4; phase++) {
+        for (i = 0; i < FRAG_BLOCKS; i++) {
+            if (phase % 2 == 0) {
+                if (blocks[i]) {
+                    continue;
+                }
+                start = now_ns();
+                blocks[i] = malloc(phase == 0 ? 16 + next_random(&seed) % 240 : 1024 + next_random(&seed) % 3072);
+                if (i % LATENCY_STRIDE == 0) {
+                    record(&rec, start);
+                }
+                memset(blocks[i], 1, 16);
+            } else if (next_random(&seed) % 10) {
+                free(blocks[i]);
+                blocks[i] = NULL;
+            }
+            rec.ops++;
+        }
+        printf("rss%d %zu\n", phase, current_rss());
+    }
+    for (i = 0; i < FRAG_BLOCKS; i++) {
+        free(blocks[i]);
+    }
+    printf("rss_end %zu\n", current_rss());
+    merge(&rec);
+}
+
+static int compare_u64(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+static uint64_t percentile(double p) {
+    size_t i = (size_t)(p * (result.num_latencies - 1));
+    return result.num_latencies ? result.latencies[i] : 0;
+}
+
+typedef struct {
+    const char* name;
+    size_t size; // for the per-size loops
+    void (*run)();
+} workload_t;
+
+static const workload_t workloads[] = {
+    {"size-16", 16, NULL},
+    {"size-64", 64, NULL},
+    {"size-256", 256, NULL},
+    {"size-512", 512, NULL},
+    {"size-4096", 4096, NULL},
+    {"size-32768", 32768, NULL},
+    {"size-262144", 262144, NULL},
+    {"producer-consumer", 0, bench_producer_consumer},
+    {"larson", 0, bench_larson},
+    {"realloc-growth", 0, bench_realloc},
+    {"fragmentation", 0, bench_fragmentation},
+};
+
+#define NUM_WORKLOADS (sizeof(workloads) / sizeof(workloads[0]))
+
+// the child side: run one workload and print "key value" lines
+static int run_workload(const char* name) {
+    struct rusage usage;
+    uint64_t start;
+    size_t i;
+
+    for (i = 0; i < NUM_WORKLOADS && strcmp(workloads[i].name, name); i++) {
+    }
+    if (i == NUM_WORKLOADS) {
+        fprintf(stderr, "unknown workload %s\n", name);
+        return 1;
+    }
+    pthread_mutex_init(&result.lock, NULL);
+    result.latencies = malloc(LATENCY_SAMPLES * sizeof(uint64_t));
+
+    start = now_ns();
+    if (workloads[i].run) {
+        workloads[i].run();
+    } else {
+        bench_size(workloads[i].size, workloads[i].size > 65536 ? 200000 : 2000000);
+    }
+    result.seconds = (now_ns() - start) / 1e9;
+
+    qsort(result.latencies, result.num_latencies, sizeof(uint64_t), compare_u64);
+    getrusage(RUSAGE_SELF, &usage);
+    printf("ops_per_sec %.0f\n", result.ops / result.seconds);
+    printf("p50 %llu\n", (unsigned long long)percentile(0.5));
+    printf("p99 %llu\n", (unsigned long long)percentile(0.99));
+    printf("p999 %llu\n", (unsigned long long)percentile(0.999));
+    printf("peak_rss %ld\n", usage.ru_maxrss * 1024);
+    return 0;
+}
+
+typedef struct {
+    char keys[16][32];
+    double values[16];
+    int count;
+} report_t;
+
+// rerun ourselves on one workload, preloading library when it is not NULL
+static int spawn(const char* self, const char* workload, const char* library, report_t* report) {
+    int fds[2], status;
+    char line[128];
+    FILE* out;
+    pid_t pid;
+
+    if (pipe(fds)) {
+        return -1;
+    }
+    pid = fork();
+    if (pid == 0) {
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        if (library) {
+            setenv("LD_PRELOAD", library, 1);
+        } else {
+            unsetenv("LD_PRELOAD");
+        }
+        execl(self, self, "--run", workload, (char*)NULL);
+        _exit(127);
+    }
+    close(fds[1]);
+    out = fdopen(fds[0], "r");
+    report->count = 0;
+    while (fgets(line, sizeof(line), out) && report->count < 16) {
+        if (sscanf(line, "%31s %lf", report->keys[report->count], &report->values[report->count]) == 2) {
+            report->count++;
+        }
+    }
+    fclose(out);
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status)) {
+        return -1;
+    }
+    return 0;
+}
+
+static void print_value(const char* key, double value) {
+    if (!strcmp(key, "ops_per_sec")) {
+        printf(" %12.0f", value);
+    } else if (!strncmp(key, "rss", 3) || !strcmp(key, "peak_rss")) {
+        printf(" %10.1fM", value / (1 << 20));
+    } else {
+        printf(" %9.0fns", value);
+    }
+}
+
+int main(int argc, char** argv) {
+    report_t reports[2];
+    const char* library;
+    size_t i;
+    int j, k, failed = 0;
+
+    if (argc == 3 && !strcmp(argv[1], "--run")) {
+        return run_workload(argv[2]);
+    }
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s ./libmalloc.so [workload...]\n", argv[0]);
+        return 1;
+    }
+    library = realpath(argv[1], NULL);
+    if (!library) {
+        perror(argv[1]);
+        return 1;
+    }
+
+    for (i = 0; i < NUM_WORKLOADS; i++) {
+        for (j = 2; j < argc && strcmp(argv[j], workloads[i].name); j++) {
+        }
+        if (argc > 2 && j == argc) {
+            continue;
+        }
+        if (spawn(argv[0], workloads[i].name, NULL, &reports[0])
+            || spawn(argv[0], workloads[i].name, library, &reports[1])) {
+            printf("%-20s failed\n", workloads[i].name);
+            failed = 1;
+            continue;
+        }
+        printf("%s\n", workloads[i].name);
+        for (k = 0; k < reports[0].count; k++) {
+            printf("  %-12s glibc", reports[0].keys[k]);
+            print_value(reports[0].keys[k], reports[0].values[k]);
+            printf("   libmalloc");
+            print_value(reports[0].keys[k], k < reports[1].count ? reports[1].values[k] : 0);
+            if (reports[0].values[k]) {
+                printf("   %+6.1f%%", 100 * ((k < reports[1].count ? reports[1].values[k] : 0)
+                                           / reports[0].values[k] - 1));
+            }
+            printf("\n");
+        }
+        fflush(stdout);
+    }
+    return failed;
+}
@@ -1,263 +1,4116 @@
 /*
 how to run this
 
-gcc -o malloc malloc.c -lpthread
+make malloc
 ./malloc
+
+or build the drop-in library and preload it under an existing binary
+
+make libmalloc.so
+LD_PRELOAD=./libmalloc.so ls
 */
 
+#define _GNU_SOURCE // mremap
 #include <stddef.h>
+#include <stdint.h>
+#include <errno.h>
 #include <string.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/auxv.h>
+#include <fcntl.h>
+#include <sched.h>
+#if defined(__x86_64__) && __has_include(<sys/rseq.h>)
+#include <sys/rseq.h>
+#define HAVE_RSEQ 1
+#endif
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define HAVE_STREAMING_STORES 1
+#endif
+#include <time.h>
+#include <stdarg.h>
+#include <signal.h>
+#include <execinfo.h>
+#include <malloc.h>
 
-#define ALIGNMENT 8
+#define ALIGNMENT 16
 #define ALIGN(size) (((size) + (ALIGNMENT-1)) & ~(ALIGNMENT-1))
-#define POOL_SIZE (1024 * 1024) // 1 MB
+#define POOL_SIZE (1024 * 1024) // 1 MB, default size of the first segment
+
+// node 0 starts out on a static segment instead, so that what libc and ld.so
+// allocate before our constructor has run needs no system call
+#ifndef BOOTSTRAP_SIZE
+#define BOOTSTRAP_SIZE (256 * 1024)
+#endif
+
+// the heap grows by mapping further segments, each SEGMENT_GROWTH times the
+// previous one, until MAX_HEAP_SIZE bytes are mapped
+#define SEGMENT_GROWTH 2
+#define MAX_SEGMENTS 64
+#ifndef MAX_HEAP_SIZE
+#define MAX_HEAP_SIZE ((size_t)16 << 30) // 16 GB
+#endif
+#define PAGE_ALIGN(size) (((size) + 4095) & ~(size_t)4095)
+
+// realloc and calloc copy and zero payloads with their own kernels: an
+// unrolled loop up to TCACHE_MAX_SIZE, libc's memcpy and memset in between,
+// and from NONTEMPORAL_THRESHOLD on, streaming stores that bypass the cache
+// when CPUID reports AVX2 or AVX-512
+#ifndef NONTEMPORAL_THRESHOLD
+#define NONTEMPORAL_THRESHOLD (1024 * 1024)
+#endif
+#define PAGE_FLOOR(size) ((size) & ~(size_t)4095)
+
+// free pool memory that has stayed untouched for the decay time is handed back
+// to the kernel with madvise, checked whenever a large block is freed
+#ifndef PURGE_DECAY_MS
+#define PURGE_DECAY_MS 10000
+#endif
+#define PURGE_MIN_SIZE (2 * 4096) // smallest free block that surely spans a page
+
+// pool segments can be backed by 2 MB pages: transparent huge pages with
+// HUGE_PAGES_THP, or reserved hugetlb pages with HUGE_PAGES_HUGETLB, which
+// falls back to transparent ones when no reserved page is left
+#define HUGE_PAGES_NONE 0
+#define HUGE_PAGES_THP 1
+#define HUGE_PAGES_HUGETLB 2
+#ifndef POOL_HUGE_PAGES
+#define POOL_HUGE_PAGES HUGE_PAGES_NONE
+#endif
+#define HUGE_PAGE_SIZE ((size_t)2 << 20)
+#define HUGE_ALIGN(size) (((size) + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1))
+#define HUGE_FLOOR(size) ((size) & ~(HUGE_PAGE_SIZE - 1))
+
+// requests of at least MMAP_THRESHOLD bytes (by default, see options[]) get a
+// mapping of their own that is unmapped as soon as they are freed
+#ifndef MMAP_THRESHOLD
+#define MMAP_THRESHOLD (128 * 1024)
+#endif
+
+// a pool block that realloc grows stays in the pool below this size, where
+// the next block to grow can reuse its pages; mapped blocks grow by at least
+// MMAP_GROWTH times their length, so that growing in small steps seldom remaps
+#ifndef REALLOC_MMAP_THRESHOLD
+#define REALLOC_MMAP_THRESHOLD (4 * 1024 * 1024)
+#endif
+#define MMAP_GROWTH 2
+
+// calloc goes to a fresh mapping, which needs no zeroing, from this size on
+#ifndef CALLOC_MMAP_THRESHOLD
+#define CALLOC_MMAP_THRESHOLD MMAP_THRESHOLD
+#endif
+
+// segregated free lists: one exact bin per ALIGNMENT step below SMALL_BIN_LIMIT,
+// then SUB_BINS bins per power of two above it
+#define NUM_SMALL_BINS 64
+#define SMALL_BIN_LIMIT (NUM_SMALL_BINS * ALIGNMENT)
+#define SMALL_BIN_SHIFT 10 // log2(SMALL_BIN_LIMIT)
+#define SUB_BIN_BITS 3
+#define SUB_BINS (1 << SUB_BIN_BITS)
+#define NUM_BINS (NUM_SMALL_BINS + (64 - SMALL_BIN_SHIFT) * SUB_BINS)
+#define BITMAP_WORDS ((NUM_BINS + 63) / 64)
+
+// slab allocator: objects up to SLAB_MAX_SIZE have no header and live in
+// page-sized runs of one size class, carved from a reserved address range
+#define SLAB_MAX_SIZE 128
+#define SLAB_NUM_CLASSES (SLAB_MAX_SIZE / ALIGNMENT)
+#define SLAB_RUN_SIZE 4096
+#define SLAB_COMMIT_SIZE (64 * 1024) // made accessible this much at a time
+#ifndef SLAB_REGION_SIZE
+#define SLAB_REGION_SIZE ((size_t)1 << 30) // 1 GB of address space
+#endif
+
+// page map: a two-level radix tree over the 48-bit address space telling,
+// for every page we hand out memory from, what lives there
+#define PAGEMAP_LEAF_BITS 18
+#define PAGEMAP_ROOT_BITS (48 - 12 - PAGEMAP_LEAF_BITS)
+#define PAGEMAP_LEAF_SIZE ((size_t)sizeof(uintptr_t) << PAGEMAP_LEAF_BITS)
+#define PAGE_SLAB 1    // entries are a segment_t* for pool pages or one of these
+#define PAGE_MMAPPED 2 // the page holding a large block's payload start
+
+// one pool and one slab heap per NUMA node, bound to the node's memory
+#ifndef MAX_NUMA_NODES
+#define MAX_NUMA_NODES 8
+#endif
+#define MPOL_PREFERRED 1
+
+// per-thread cache: blocks up to TCACHE_MAX_SIZE are cached per size class.
+// The bin limits are defaults, but no bin can hold more than TCACHE_BIN_CAPACITY.
+#define TCACHE_MAX_SIZE 512
+#define TCACHE_NUM_CLASSES (TCACHE_MAX_SIZE / ALIGNMENT)
+#define TCACHE_BIN_CAPACITY 64
+#define TCACHE_BIN_BYTES 4096
+
+// central lists between the caches and the heap hold this many times a
+// cache bin's capacity per class
+#define CENTRAL_CAPACITY_FACTOR 8
 
+// thread caches that go unused for a whole scavenge interval have their bins
+// taken back to the central lists by whichever thread next runs short, 0 to
+// never scavenge. Taking another thread's bins relies on membarrier(2).
+#ifndef SCAVENGE_INTERVAL_MS
+#define SCAVENGE_INTERVAL_MS 1000
+#endif
+#define MEMBARRIER_CMD_PRIVATE_EXPEDITED (1 << 3)
+#define MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED (1 << 4)
+
+// per-CPU caches: an alternative front end to the thread caches, with bins of
+// the same capacity updated inside rseq critical sections. Used when built
+// with PERCPU_CACHES on a single-node machine whose kernel supports rseq.
+#ifndef PERCPU_CACHES
+#define PERCPU_CACHES 0
+#endif
+#ifndef MAX_CPUS
+#define MAX_CPUS 1024
+#endif
+
+// heap profiling samples one allocation per PROFILE_SAMPLE_RATE bytes on
+// average, 0 for none, keeping up to PROFILE_MAX_DEPTH return addresses each
+#ifndef PROFILE_SAMPLE_RATE
+#define PROFILE_SAMPLE_RATE 0
+#endif
+#define PROFILE_MAX_DEPTH 32
+#define PROFILE_BUCKET_BITS 14
+
+// hardened builds check headers and list links against a per-process secret,
+// catch double frees and pointers into the middle of blocks, and abort on any
+// of them instead of corrupting the heap
+#ifndef HARDENED
+#define HARDENED 0
+#endif
+
+// every block starts with one word: its payload size with the BLOCK_* flags
+// packed into the low bits. Only free blocks carry more metadata: their
+// free-list links at the start of the payload and their size in its last word.
 typedef struct Header {
     size_t size;
-    struct Header* next;
-    struct Header* prev;
-    int is_free;
 } header_t;
 
+// in hardened builds the top bits of the word hold a check of the header's
+// address and value, which sizes below 2^48 leave free
+#define HEADER_VALUE_MASK (HARDENED ? ((size_t)1 << 48) - 1 : ~(size_t)0)
+
+#define BLOCK_FREE 1      // block is on a free list
+#define BLOCK_PREV_FREE 2 // boundary tag: the physically preceding block is free
+#define BLOCK_MMAPPED 4   // block is a mapping of its own, outside every segment
+#define BLOCK_FLAGS (BLOCK_FREE | BLOCK_PREV_FREE | BLOCK_MMAPPED)
+
 typedef struct {
-    header_t* head;
-    header_t* tail;
+    header_t* next;
+    header_t* prev;
+} free_links_t;
+
+// headers sit sizeof(header_t) below an ALIGNMENT boundary, so pool payload
+// sizes are a multiple of ALIGNMENT minus the header. The smallest one must
+// hold the free-list links and the footer.
+#define BLOCK_ALIGN(size) (ALIGN((size) + sizeof(header_t)) - sizeof(header_t))
+#define MIN_BLOCK_SIZE BLOCK_ALIGN(sizeof(free_links_t) + sizeof(size_t))
+
+// a large block's mapping starts with a word holding the distance from the
+// mapping start to the payload, followed by the header
+#define MMAP_OVERHEAD (sizeof(size_t) + sizeof(header_t))
+
+// a segment is one mmap'd region: this header, the blocks up to the bump
+// pointer top, and room for the fence header that closes it off at limit
+typedef struct Segment {
+    size_t size;
+    char* top;
+    char* limit;
+    char* pristine; // nothing from here to limit was ever written, so it is still zero
+    struct MemoryPool* pool;
+    int huge; // HUGE_PAGES_* it is backed by
+} segment_t;
+
+#define SEGMENT_HEADER_SIZE BLOCK_ALIGN(sizeof(segment_t))
+
+// header at the start of every slab run; found by masking an object's address
+typedef struct Run {
+    struct Run* next; // in the class' partial list or the empty-run list
+    struct Run* prev;
+    void* free_list;  // freed objects, linked through their first word
+    char* carve;      // objects from here on have never been handed out
+    struct RemoteFreeList* owner; // thread cache that last took objects from the run
+    unsigned int size_class;
+    unsigned int free_count;
+} run_t;
+
+#define SLAB_RUN_HEADER_SIZE ALIGN(sizeof(run_t))
+
+typedef struct {
+    unsigned int node;
+    char* start;                          // reserved range, PROT_NONE above committed
+    char* end;
+    char* top;                            // next run never used before
+    char* committed;
+    run_t* partial[SLAB_NUM_CLASSES];     // runs with at least one free object
+    run_t* empty;                         // runs with no live object, any class
+    size_t committed_memory;
+} slab_heap_t;
+
+typedef struct MemoryPool {
+    header_t* bins[NUM_BINS];
+    uint64_t bin_bitmap[BITMAP_WORDS]; // bit set when the bin is non-empty
+    uint64_t bin_summary;              // bit set when the bitmap word is non-zero
+    segment_t* segments[MAX_SEGMENTS]; // sorted by address
+    unsigned int num_segments;
+    segment_t* current;                // the segment being bump-allocated from
+    size_t mapped_memory;
     size_t allocated_memory;
     size_t free_memory;
+    size_t dirty_memory;   // unpurged pages inside large free blocks
+    size_t purged_memory;  // total ever handed back with madvise
+    char* dirty_end;       // pages between current->top and here were used
+    uint64_t dirty_end_since;
+    uint64_t next_purge;   // earliest time of the next purge pass, in ms
+    int node;              // NUMA node its segments are bound to, -1 for none
 } memory_pool_t;
 
-static memory_pool_t global_pool = {NULL, NULL, 0, 0};
+static memory_pool_t node_pools[MAX_NUMA_NODES];
+static slab_heap_t node_slabs[MAX_NUMA_NODES];
+static unsigned int num_nodes = 1;
+static char* slab_region_start; // node_slabs[] split this range between them
+static char* slab_region_end;
+static size_t mmapped_memory; // large blocks, updated atomically outside the lock
+static uintptr_t* pagemap_root[1 << PAGEMAP_ROOT_BITS]; // leaves mapped on first use
 static pthread_mutex_t global_malloc_lock = PTHREAD_MUTEX_INITIALIZER;
-static pthread_once_t pool_initialized = PTHREAD_ONCE_INIT;
-static void* pool_start = NULL;
+static int malloc_ready; // nodes, slabs and per-CPU caches are set up, see initialize_memory_pool
+static char bootstrap_memory[BOOTSTRAP_SIZE] __attribute__((aligned(4096)));
+static uintptr_t bootstrap_leaf[1 << PAGEMAP_LEAF_BITS]; // page map leaf of bootstrap_memory
+static uint64_t purge_decay_ms = PURGE_DECAY_MS;
+static uint64_t huge_pages = POOL_HUGE_PAGES;
+static uint64_t segment_size = POOL_SIZE; // rounded to pages where used
+static uint64_t mmap_threshold = MMAP_THRESHOLD;
+static uint64_t calloc_mmap_threshold = CALLOC_MMAP_THRESHOLD;
+static uint64_t realloc_mmap_threshold = REALLOC_MMAP_THRESHOLD;
+static uint64_t tcache_capacity = TCACHE_BIN_CAPACITY;
+static uint64_t tcache_bytes = TCACHE_BIN_BYTES;
+static uint64_t narenas = MAX_NUMA_NODES; // node pools in use, at most one per node
+
+typedef struct {
+    void* head; // cached payloads, linked through their first word
+    unsigned int count;
+} tcache_bin_t;
+
+// lock-free MPSC stack of slab objects freed by threads other than the owner.
+// These live outside TLS and are recycled, never unmapped, so a stale owner
+// pointer in a run can always be pushed to (or seen as REMOTE_CLOSED).
+typedef struct RemoteFreeList {
+    void* head;
+    struct RemoteFreeList* next_unused;
+} remote_free_list_t;
+
+#define REMOTE_CLOSED ((void*)1)
+#define REMOTE_CHUNK_SIZE (64 * 1024)
+
+// statistics, counted per thread so that the hot path only ever writes its own
+// cache lines; mallctl() and malloc_stats_write() add them up on demand.
+// Classes are the cache classes by rounded request size, then one for all
+// larger sizes; a free counts under the class its block's size rounds down to,
+// which is a larger one when the block was handed out with slack.
+#define STATS_NUM_CLASSES (TCACHE_NUM_CLASSES + 1)
+
+typedef struct {
+    uint64_t allocs;
+    uint64_t frees;
+    uint64_t bytes_allocated;
+    uint64_t bytes_freed;
+} class_stats_t;
+
+// written only by the owning thread; blocks are never unmapped, and one left
+// behind by an exiting thread is adopted with its counts by the next new one
+typedef struct ThreadStats {
+    class_stats_t classes[STATS_NUM_CLASSES];
+    uint64_t slow_allocs;   // cache refills from the central lists or the heap
+    uint64_t slow_frees;    // cache flushes
+    uint64_t lock_waits;    // heap and central lock acquisitions that blocked
+    uint64_t lock_wait_ns;
+    uint64_t segments_mapped;
+    uint64_t segments_unmapped;
+    struct ThreadStats* next; // every block ever created
+    struct ThreadStats* next_unused;
+} thread_stats_t;
+
+typedef struct ThreadCache {
+    unsigned int seq;        // odd while the owner uses its bins, see tcache_enter
+    int scavenging;          // set while another thread may be taking the bins
+    tcache_bin_t bins[TCACHE_NUM_CLASSES];
+    unsigned int seen_seq;   // seq at the last scavenger pass
+    int swept;               // bins taken since seq last changed
+    struct ThreadCache* next; // on all_thread_caches, under scavenge_lock
+    struct ThreadCache* prev;
+    remote_free_list_t* remote;
+    thread_stats_t* stats;
+    int64_t sample_countdown; // bytes left until the next profile sample
+    uint64_t sample_seed;
+    int in_profiler;
+    unsigned int node; // where the thread last refilled, so where its blocks live
+    int state; // 0 = unused, 1 = active, -1 = torn down at thread exit
+} thread_cache_t;
+
+static __thread thread_cache_t thread_cache;
+// array stacks rather than lists: an rseq critical section can only commit a
+// single store, the new count
+typedef struct {
+    size_t count;
+    void* slots[TCACHE_BIN_CAPACITY];
+} percpu_bin_t;
+
+typedef struct {
+    percpu_bin_t bins[TCACHE_NUM_CLASSES];
+} percpu_cache_t;
+
+// blocks on their way between the caches and the heap, one list per node and
+// cache class, each under its own lock: refills and flushes of different
+// classes never wait on each other, and only reach global_malloc_lock when
+// their list is empty or full
+typedef struct {
+    pthread_mutex_t lock;
+    void* head; // linked through their first word like cache bins
+    unsigned int count;
+} central_list_t;
+
+static central_list_t central_lists[MAX_NUMA_NODES][TCACHE_NUM_CLASSES];
+
+static percpu_cache_t* percpu_caches; // one per possible CPU, NULL when disabled
+static unsigned int num_cpus;
+
+static pthread_key_t thread_cache_key;
+static pthread_once_t thread_cache_key_created = PTHREAD_ONCE_INIT;
+static remote_free_list_t* unused_remote_lists;
+static char* remote_chunk_top; // remote lists and thread stats are carved from here
+static char* remote_chunk_end;
+static thread_stats_t* all_thread_stats;
+static thread_stats_t* unused_thread_stats;
+static thread_stats_t shared_stats; // threads without their own, updated atomically
+static pthread_mutex_t scavenge_lock = PTHREAD_MUTEX_INITIALIZER; // taken before any other
+static thread_cache_t* all_thread_caches;
+static uint64_t scavenge_interval_ms = SCAVENGE_INTERVAL_MS;
+static uint64_t next_scavenge;
+static size_t scavenged_blocks;
+static int scavenge_barrier; // membarrier registered, so bins can be taken
+
+// a sampled block that is still live, hashed by address
+typedef struct Sample {
+    struct Sample* next;
+    void* ptr;
+    size_t size;
+    int depth;
+    void* stack[PROFILE_MAX_DEPTH];
+} sample_t;
+
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t profile_rate = PROFILE_SAMPLE_RATE;
+static sample_t* sample_buckets[1 << PROFILE_BUCKET_BITS]; // read without the lock by free
+static sample_t* unused_samples;
+static size_t live_samples;
+static uint64_t sampled_allocs;
+static uint64_t sampled_bytes;
+static char profile_path[256]; // where malloc_profile_signal() dumps
+static volatile sig_atomic_t profile_dump_pending;
+
+// prefer the node's memory for the range; the kernel falls back elsewhere
+// rather than failing when the node runs out
+static void bind_to_node(void* start, size_t length, unsigned int node) {
+    uint64_t mask = 1ULL << node;
+
+    if (num_nodes > 1) {
+        syscall(SYS_mbind, start, length, MPOL_PREFERRED, &mask, sizeof(mask) * 8 + 1, 0);
+    }
+}
+
+// map size bytes (a multiple of HUGE_PAGE_SIZE) backed by huge pages, with
+// the kind that was actually used stored in *huge
+static void* huge_mmap(size_t size, int* huge) {
+    char* start;
+    size_t lead;
+
+    if (huge_pages == HUGE_PAGES_HUGETLB) {
+        start = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE | MAP_HUGETLB, -1, 0);
+        if (start != MAP_FAILED) {
+            *huge = HUGE_PAGES_HUGETLB;
+            return start;
+        }
+    }
+
+    // transparent huge pages need 2 MB alignment: over-map and trim
+    start = mmap(NULL, size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
+    if (start == MAP_FAILED) {
+        return start;
+    }
+    lead = HUGE_ALIGN((uintptr_t)start) - (uintptr_t)start;
+    if (lead) {
+        munmap(start, lead);
+    }
+    munmap(start + lead + size, HUGE_PAGE_SIZE - lead);
+    start += lead;
+    madvise(start, size, MADV_HUGEPAGE);
+    *huge = HUGE_PAGES_THP;
+    return start;
+}
+
+// segments are mapped in whole pages of this size
+static size_t segment_granule() {
+    return huge_pages != HUGE_PAGES_NONE ? HUGE_PAGE_SIZE : 4096;
+}
+
+static uintptr_t pagemap_get(void* ptr) {
+    uintptr_t page = (uintptr_t)ptr >> 12;
+    uintptr_t* leaf;
+
+    if (page >> (PAGEMAP_ROOT_BITS + PAGEMAP_LEAF_BITS)) {
+        return 0;
+    }
+    leaf = __atomic_load_n(&pagemap_root[page >> PAGEMAP_LEAF_BITS], __ATOMIC_ACQUIRE);
+    return leaf ? leaf[page & ((1 << PAGEMAP_LEAF_BITS) - 1)] : 0;
+}
+
+// record value for every page of [start, start + length); callers own the
+// range, so only the leaves are shared and they are installed with a CAS
+static int pagemap_set(void* start, size_t length, uintptr_t value) {
+    uintptr_t page = (uintptr_t)start >> 12;
+    uintptr_t end = ((uintptr_t)start + length + 4095) >> 12;
+    uintptr_t* leaf, *expected;
+
+    if (end > (uintptr_t)1 << (PAGEMAP_ROOT_BITS + PAGEMAP_LEAF_BITS)) {
+        return 0;
+    }
+    for (; page < end; page++) {
+        leaf = __atomic_load_n(&pagemap_root[page >> PAGEMAP_LEAF_BITS], __ATOMIC_ACQUIRE);
+        if (!leaf) {
+            if (!value) {
+                page |= (1 << PAGEMAP_LEAF_BITS) - 1; // nothing to clear in this leaf
+                continue;
+            }
+            leaf = mmap(NULL, PAGEMAP_LEAF_SIZE, PROT_READ | PROT_WRITE,
+                        MAP_ANON | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+            if (leaf == MAP_FAILED) {
+                return 0;
+            }
+            expected = NULL;
+            if (!__atomic_compare_exchange_n(&pagemap_root[page >> PAGEMAP_LEAF_BITS], &expected, leaf,
+                                             0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                munmap(leaf, PAGEMAP_LEAF_SIZE);
+                leaf = expected;
+            }
+        }
+        leaf[page & ((1 << PAGEMAP_LEAF_BITS) - 1)] = value;
+    }
+    return 1;
+}
+
+// what a freed or reallocated pointer turned out not to be ours, or what the
+// hardened checks found corrupted
+static void invalid_pointer(const char* message) {
+    write(STDERR_FILENO, message, strlen(message));
+    abort();
+}
+
+// hardened builds: taken from the random bytes the kernel passes every
+// process. Set before the first segment, slab region or large block exists,
+// which may be before initialize_memory_pool() runs.
+static uintptr_t heap_secret;
+
+static void hardened_initialize() {
+    uintptr_t* random;
+
+    if (HARDENED && !heap_secret) {
+        random = (uintptr_t*)getauxval(AT_RANDOM);
+        heap_secret = ((random ? random[0] ^ random[1] : 0) ^ (uintptr_t)&heap_secret) | 1;
+    }
+}
 
-void initialize_memory_pool() {
-    pool_start = mmap(NULL, POOL_SIZE, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
-    if (pool_start == MAP_FAILED) {
-        pool_start = NULL;
-        fprintf(stderr, "Memory pool initialization failed\n");
-        exit(EXIT_FAILURE);
+// cache, central, remote and slab free lists are linked through the first
+// word of each block. Hardened builds store the link masked with the secret
+// and the block's own page (safe-linking), so a stray write into a freed
+// block rarely decodes to an aligned address.
+static void* link_get(void* block) {
+    uintptr_t next = *(uintptr_t*)block;
+
+    if (HARDENED) {
+        next ^= heap_secret ^ ((uintptr_t)block >> 12);
+        if (next & (ALIGNMENT - 1)) {
+            invalid_pointer("malloc(): corrupted free list\n");
+        }
     }
-    printf("Memory pool initialized at %p\n", pool_start);
+    return (void*)next;
+}
+
+static void link_set(void* block, void* next) {
+    *(uintptr_t*)block = HARDENED ? (uintptr_t)next ^ heap_secret ^ ((uintptr_t)block >> 12)
+                                  : (uintptr_t)next;
 }
 
-void add_to_free_list(header_t* block) {
-    block->is_free = 1;
-    block->next = global_pool.head;
-    if (global_pool.head) {
-        global_pool.head->prev = block;
+// hardened builds mark a block freed by the program with a key in its second
+// word until it is handed out again, like glibc's tcache, so that a second
+// free of a cached block is caught without searching the caches
+static uintptr_t free_key(void* block) {
+    return heap_secret ^ (uintptr_t)block ^ 0x5555555555555555ULL;
+}
+
+static void mark_freed(void* block) {
+    if (HARDENED) {
+        ((uintptr_t*)block)[1] = free_key(block);
     }
-    global_pool.head = block;
-    if (!global_pool.tail) {
-        global_pool.tail = global_pool.head;
+}
+
+static void unmark_freed(void* block) {
+    if (HARDENED) {
+        ((uintptr_t*)block)[1] = 0;
     }
-    global_pool.free_memory += block->size;
 }
 
-void remove_from_free_list(header_t* block) {
-    if (block->prev) {
-        block->prev->next = block->next;
+// the calling thread's stats; never sets up a thread cache, which may need the
+// lock being counted. Torn-down caches have none.
+static thread_stats_t* thread_stats() {
+    return thread_cache.stats ? thread_cache.stats : &shared_stats;
+}
+
+// no other thread writes an owned counter, so a plain load and store does and
+// concurrent readers see either value
+static void stat_add(thread_stats_t* stats, uint64_t* counter, uint64_t n) {
+    if (stats == &shared_stats) {
+        __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
     } else {
-        global_pool.head = block->next;
+        __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+    }
+}
+
+static thread_cache_t* get_thread_cache();
+
+// the rest of stat_blocks(): large sizes and threads without stats of their own
+static void stat_blocks_slow(size_t size, uint64_t n, int freed) {
+    thread_stats_t* stats;
+    class_stats_t* class;
+
+    if (thread_cache.state == 0) {
+        get_thread_cache();
+    }
+    stats = thread_stats();
+    if (size <= TCACHE_MAX_SIZE) {
+        class = &stats->classes[size / ALIGNMENT - 1];
+        stat_add(stats, freed ? &class->frees : &class->allocs, n);
+        return;
     }
-    if (block->next) {
-        block->next->prev = block->prev;
+    class = &stats->classes[TCACHE_NUM_CLASSES];
+    if (freed) {
+        stat_add(stats, &class->frees, n);
+        stat_add(stats, &class->bytes_freed, size * n);
     } else {
-        global_pool.tail = block->prev;
+        stat_add(stats, &class->allocs, n);
+        stat_add(stats, &class->bytes_allocated, size * n);
     }
-    global_pool.free_memory -= block->size;
 }
 
-header_t* get_free_block(size_t size) {
-    header_t* curr = global_pool.head;
-    while (curr) {
-        if (curr->is_free && curr->size >= size) {
-            remove_from_free_list(curr);
-            return curr;
-        }
-        curr = curr->next;
+// count n blocks of size allocated, or freed; callers must not hold
+// global_malloc_lock unless the thread's cache is set up already, which this
+// does for threads only using per-CPU caches. Inline as it is on every malloc
+// and free; small classes only count blocks, stats_snapshot() works out bytes.
+static inline void stat_blocks(size_t size, uint64_t n, int freed) {
+    thread_stats_t* stats = thread_cache.stats;
+    uint64_t* counter;
+
+    if (!stats || size > TCACHE_MAX_SIZE) {
+        stat_blocks_slow(size, n, freed);
+        return;
     }
-    return NULL;
+    counter = freed ? &stats->classes[size / ALIGNMENT - 1].frees : &stats->classes[size / ALIGNMENT - 1].allocs;
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
 }
 
-void split_block(header_t* block, size_t size) {
-    if (block->size >= size + sizeof(header_t) + ALIGNMENT) {
-        header_t* new_block = (header_t*)((char*)block + sizeof(header_t) + size);
-        new_block->size = block->size - size - sizeof(header_t);
-        block->size = size;
-        add_to_free_list(new_block);
+// lock, timing the wait only when the lock is contended
+static void timed_lock(pthread_mutex_t* lock) {
+    thread_stats_t* stats;
+    struct timespec start, end;
+
+    if (pthread_mutex_trylock(lock) == 0) {
+        return;
     }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pthread_mutex_lock(lock);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    stats = thread_stats();
+    stat_add(stats, &stats->lock_waits, 1);
+    stat_add(stats, &stats->lock_wait_ns,
+             (uint64_t)(end.tv_sec - start.tv_sec) * 1000000000 + end.tv_nsec - start.tv_nsec);
 }
 
-void coalesce_free_blocks() {
-    header_t* curr = global_pool.head;
-    while (curr && curr->next) {
-        if ((char*)curr + curr->size + sizeof(header_t) == (char*)curr->next) {
-            curr->size += curr->next->size + sizeof(header_t);
-            remove_from_free_list(curr->next);
-        } else {
-            curr = curr->next;
-        }
+// record a new segment in the page map and in its pool
+static int segment_attach(memory_pool_t* pool, segment_t* segment, size_t size, int huge) {
+    unsigned int i;
+
+    hardened_initialize();
+    if (!pagemap_set(segment, size, (uintptr_t)segment)) {
+        return 0;
+    }
+    segment->size = size;
+    segment->pool = pool;
+    segment->huge = huge;
+    segment->top = (char*)segment + SEGMENT_HEADER_SIZE;
+    segment->limit = (char*)segment + size - sizeof(header_t);
+    segment->pristine = segment->top;
+
+    i = pool->num_segments++;
+    while (i > 0 && pool->segments[i - 1] > segment) {
+        pool->segments[i] = pool->segments[i - 1];
+        i--;
     }
+    pool->segments[i] = segment;
+    pool->mapped_memory += size;
+    stat_add(thread_stats(), &thread_stats()->segments_mapped, 1);
+    return 1;
 }
 
-void* malloc(size_t size) {
-    size_t total_size;
-    void* block;
-    header_t* header;
+static segment_t* segment_create(memory_pool_t* pool, size_t size) {
+    segment_t* segment;
+    int huge = HUGE_PAGES_NONE;
 
-    if (size == 0) {
+    if (pool->num_segments == MAX_SEGMENTS) {
+        return NULL;
+    }
+    if (huge_pages != HUGE_PAGES_NONE) {
+        size = HUGE_ALIGN(size);
+        segment = huge_mmap(size, &huge);
+    } else {
+        segment = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
+    }
+    if (segment == MAP_FAILED) {
+        return NULL;
+    }
+    if (!segment_attach(pool, segment, size, huge)) {
+        munmap(segment, size);
         return NULL;
     }
+    if (pool->node >= 0) {
+        bind_to_node(segment, size, pool->node);
+    }
+    return segment;
+}
 
-    pthread_once(&pool_initialized, initialize_memory_pool);
+// node 0's first segment, in .bss and already zero, with a static page map
+// leaf unless the one it falls in was mapped first. It is never unmapped.
+static segment_t* segment_bootstrap(memory_pool_t* pool) {
+    uintptr_t** root = &pagemap_root[(uintptr_t)bootstrap_memory >> (12 + PAGEMAP_LEAF_BITS)];
+    uintptr_t* expected = NULL;
 
-    size = ALIGN(size);
-    pthread_mutex_lock(&global_malloc_lock);
-    header = get_free_block(size);
-    if (header) {
-        split_block(header, size);
-        header->is_free = 0;
-        pthread_mutex_unlock(&global_malloc_lock);
-        return (void*)(header + 1);
+    if (pool != &node_pools[0] || pool->num_segments) {
+        return NULL;
     }
-
-    total_size = size + sizeof(header_t);
-    if (!pool_start || (char*)pool_start + POOL_SIZE - (char*)global_pool.tail - total_size < 0) {
-        pthread_mutex_unlock(&global_malloc_lock);
+    __atomic_compare_exchange_n(root, &expected, bootstrap_leaf, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+    if (!segment_attach(pool, (segment_t*)bootstrap_memory, BOOTSTRAP_SIZE, HUGE_PAGES_NONE)) {
         return NULL;
     }
+    return (segment_t*)bootstrap_memory;
+}
 
-    header = (header_t*)((char*)pool_start + global_pool.allocated_memory);
-    header->size = size;
-    header->next = NULL;
-    header->prev = NULL;
-    header->is_free = 0;
+// hardened builds: n is a multiple of a class' size exactly when
+// n * slab_divisors[class] wraps to below slab_divisors[class], which saves
+// a division on every free
+static uint32_t slab_divisors[SLAB_NUM_CLASSES];
 
-    if (global_pool.tail) {
-        global_pool.tail->next = header;
-        header->prev = global_pool.tail;
-        global_pool.tail = header;
-    } else {
-        global_pool.head = global_pool.tail = header;
+// reserve address space for slab runs, SLAB_REGION_SIZE per node; without it
+// small objects use the pool
+static void slab_initialize() {
+    char* start = mmap(NULL, SLAB_REGION_SIZE * num_nodes, PROT_NONE,
+                       MAP_ANON | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+    unsigned int i;
+
+    if (start == MAP_FAILED) {
+        return;
+    }
+    hardened_initialize();
+    for (i = 0; i < SLAB_NUM_CLASSES; i++) {
+        slab_divisors[i] = UINT32_MAX / ((i + 1) * ALIGNMENT) + 1;
+    }
+    slab_region_start = start;
+    slab_region_end = start + SLAB_REGION_SIZE * num_nodes;
+    for (i = 0; i < num_nodes; i++) {
+        node_slabs[i].node = i;
+        node_slabs[i].start = node_slabs[i].top = node_slabs[i].committed = start;
+        start += SLAB_REGION_SIZE;
+        node_slabs[i].end = start;
     }
+}
 
-    global_pool.allocated_memory += total_size;
-    block = (void*)(header + 1);
-    pthread_mutex_unlock(&global_malloc_lock);
-    return block;
+// count the entries of a sysfs range list such as "0" or "0-3", up to max,
+// without stdio since it may allocate while we are being initialized
+static unsigned int sysfs_count(const char* path, unsigned int max) {
+    char buf[64], *p;
+    ssize_t len;
+    unsigned int last = 0;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0) {
+        return 1;
+    }
+    len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (len <= 0) {
+        return 1;
+    }
+    buf[len] = '\0';
+    for (p = buf; *p; p++) {
+        if (*p == '-' || *p == ',') {
+            last = 0;
+        } else if (*p >= '0' && *p <= '9') {
+            last = last * 10 + (*p - '0');
+        }
+    }
+    return last < max ? last + 1 : max;
 }
 
-void* realloc(void* block, size_t size) {
-    header_t* header;
-    void* ret;
-    if (!block) {
-        return malloc(size);
+#ifdef HAVE_STREAMING_STORES
+// n is a multiple of 64 and dst 64 aligned; the fence orders the streaming
+// stores before whatever publishes the block
+__attribute__((target("avx2")))
+static void stream_copy_avx2(char* dst, const char* src, size_t n) {
+    size_t i;
+
+    for (i = 0; i < n; i += 64) {
+        _mm256_stream_si256((__m256i*)(dst + i), _mm256_loadu_si256((const __m256i*)(src + i)));
+        _mm256_stream_si256((__m256i*)(dst + i + 32), _mm256_loadu_si256((const __m256i*)(src + i + 32)));
     }
-    if (size == 0) {
-        free(block);
-        return NULL;
+    _mm_sfence();
+}
+
+__attribute__((target("avx2")))
+static void stream_zero_avx2(char* dst, size_t n) {
+    __m256i zero = _mm256_setzero_si256();
+    size_t i;
+
+    for (i = 0; i < n; i += 64) {
+        _mm256_stream_si256((__m256i*)(dst + i), zero);
+        _mm256_stream_si256((__m256i*)(dst + i + 32), zero);
     }
+    _mm_sfence();
+}
 
-    header = (header_t*)block - 1;
-    if (header->size >= size) {
-        return block;
+__attribute__((target("avx512f")))
+static void stream_copy_avx512(char* dst, const char* src, size_t n) {
+    size_t i;
+
+    for (i = 0; i < n; i += 64) {
+        _mm512_stream_si512((void*)(dst + i), _mm512_loadu_si512((const void*)(src + i)));
     }
+    _mm_sfence();
+}
 
-    ret = malloc(size);
-    if (ret) {
-        memcpy(ret, block, header->size);
-        free(block);
+__attribute__((target("avx512f")))
+static void stream_zero_avx512(char* dst, size_t n) {
+    __m512i zero = _mm512_setzero_si512();
+    size_t i;
+
+    for (i = 0; i < n; i += 64) {
+        _mm512_stream_si512((void*)(dst + i), zero);
     }
-    return ret;
+    _mm_sfence();
 }
+#endif
 
-void free(void* block) {
-    header_t* header, *tmp;
-    void* programbreak;
-    if (!block) {
+// set from CPUID by initialize_memory_pool, NULL for plain memcpy and memset
+static void (*stream_copy)(char* dst, const char* src, size_t n);
+static void (*stream_zero)(char* dst, size_t n);
+
+static void stream_initialize() {
+#ifdef HAVE_STREAMING_STORES
+    unsigned int eax, ebx, ecx, edx, xcr0_low, xcr0_high;
+
+    // the OS has to save the vector registers too, see XGETBV
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_OSXSAVE)
+        || !__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
         return;
     }
+    __asm__("xgetbv" : "=a"(xcr0_low), "=d"(xcr0_high) : "c"(0));
+    if ((ebx & bit_AVX512F) && (xcr0_low & 0xe6) == 0xe6) {
+        stream_copy = stream_copy_avx512;
+        stream_zero = stream_zero_avx512;
+    } else if ((ebx & bit_AVX2) && (xcr0_low & 0x6) == 0x6) {
+        stream_copy = stream_copy_avx2;
+        stream_zero = stream_zero_avx2;
+    }
+#endif
+}
 
-    pthread_once(&pool_initialized, initialize_memory_pool);
+// copy n bytes between payloads of any length: pool payloads end 8 bytes
+// short of a multiple of ALIGNMENT, so small blocks move in 32, 16 and 8 byte
+// chunks and then single bytes
+static void block_copy(void* dst, const void* src, size_t n) {
+    char* d = dst;
+    const char* s = src;
+    size_t head, i;
 
-    pthread_mutex_lock(&global_malloc_lock);
-    header = (header_t*)block - 1;
+    if (n <= TCACHE_MAX_SIZE) {
+        for (i = 0; i + 32 <= n; i += 32) {
+            __builtin_memcpy(d + i, s + i, 32);
+        }
+        if (i + 16 <= n) {
+            __builtin_memcpy(d + i, s + i, 16);
+            i += 16;
+        }
+        if (i + 8 <= n) {
+            __builtin_memcpy(d + i, s + i, 8);
+            i += 8;
+        }
+        for (; i < n; i++) {
+            d[i] = s[i];
+        }
+    } else if (n < NONTEMPORAL_THRESHOLD || !stream_copy) {
+        memcpy(d, s, n);
+    } else {
+        head = -(uintptr_t)d & 63;
+        memcpy(d, s, head);
+        stream_copy(d + head, s + head, (n - head) & ~(size_t)63);
+        i = head + ((n - head) & ~(size_t)63);
+        memcpy(d + i, s + i, n - i);
+    }
+}
 
-    programbreak = (char*)pool_start + POOL_SIZE;
-    if ((char*)block + header->size == programbreak) {
-        if (global_pool.head == global_pool.tail) {
-            global_pool.head = global_pool.tail = NULL;
-        } else {
-            tmp = global_pool.head;
-            while (tmp->next != global_pool.tail) {
-                tmp = tmp->next;
-            }
-            tmp->next = NULL;
-            global_pool.tail = tmp;
+// zero n bytes of a payload, under the same rules as block_copy()
+static void block_zero(void* dst, size_t n) {
+    char* d = dst;
+    size_t head, i;
+
+    if (n <= TCACHE_MAX_SIZE) {
+        for (i = 0; i + 32 <= n; i += 32) {
+            __builtin_memset(d + i, 0, 32);
         }
+        if (i + 16 <= n) {
+            __builtin_memset(d + i, 0, 16);
+            i += 16;
+        }
+        if (i + 8 <= n) {
+            __builtin_memset(d + i, 0, 8);
+            i += 8;
+        }
+        for (; i < n; i++) {
+            d[i] = 0;
+        }
+    } else if (n < NONTEMPORAL_THRESHOLD || !stream_zero) {
+        memset(d, 0, n);
     } else {
-        add_to_free_list(header);
-        coalesce_free_blocks();
+        head = -(uintptr_t)d & 63;
+        memset(d, 0, head);
+        stream_zero(d + head, (n - head) & ~(size_t)63);
+        i = head + ((n - head) & ~(size_t)63);
+        memset(d + i, 0, n - i);
     }
+}
 
-    pthread_mutex_unlock(&global_malloc_lock);
+static void percpu_initialize();
+void malloc_set_purge_decay(uint64_t ms);
+void malloc_set_scavenge_interval(uint64_t ms);
+
+// run-time tuning: compile-time defaults, overridden by MALLOC_CONF when the
+// library loads and through mallctl("opt.<name>") after that. set, when there
+// is one, applies a new value; the others are stored under global_malloc_lock,
+// or only read at startup when startup_only is set.
+typedef struct {
+    const char* name;
+    uint64_t* value;
+    uint64_t min;
+    uint64_t max;
+    void (*set)(uint64_t value);
+    int startup_only;
+} option_t;
+
+static const option_t options[] = {
+    {"segment_size", &segment_size, 64 * 1024, (uint64_t)1 << 30, NULL, 0},
+    {"mmap_threshold", &mmap_threshold, 4096, (uint64_t)1 << 30, NULL, 0},
+    {"calloc_mmap_threshold", &calloc_mmap_threshold, 4096, (uint64_t)1 << 30, NULL, 0},
+    {"realloc_mmap_threshold", &realloc_mmap_threshold, 4096, (uint64_t)1 << 30, NULL, 0},
+    {"tcache_capacity", &tcache_capacity, 2, TCACHE_BIN_CAPACITY, NULL, 0},
+    {"tcache_bytes", &tcache_bytes, 0, TCACHE_BIN_CAPACITY * TCACHE_MAX_SIZE, NULL, 0},
+    {"purge_decay_ms", &purge_decay_ms, 0, (uint64_t)1 << 40, malloc_set_purge_decay, 0},
+    {"huge_pages", &huge_pages, HUGE_PAGES_NONE, HUGE_PAGES_HUGETLB, NULL, 0},
+    {"scavenge_interval_ms", &scavenge_interval_ms, 0, (uint64_t)1 << 40, malloc_set_scavenge_interval, 0},
+    {"narenas", &narenas, 1, MAX_NUMA_NODES, NULL, 1},
+};
+
+#define NUM_OPTIONS (sizeof(options) / sizeof(options[0]))
+
+static const option_t* option_find(const char* name, size_t length) {
+    size_t i;
+
+    for (i = 0; i < NUM_OPTIONS; i++) {
+        if (strlen(options[i].name) == length && !strncmp(options[i].name, name, length)) {
+            return &options[i];
+        }
+    }
+    return NULL;
 }
 
-void* calloc(size_t num, size_t nsize) {
-    size_t size;
-    void* block;
+// a decimal number with an optional k, m or g suffix, ending at end; 0 when
+// it is not one or does not fit
+static int option_parse(const char* start, const char* end, uint64_t* value) {
+    uint64_t n = 0;
+    const char* c;
+    int shift = 0;
 
-    if (!num || !nsize) {
-        return NULL;
+    if (start < end && (end[-1] == 'k' || end[-1] == 'm' || end[-1] == 'g')) {
+        shift = end[-1] == 'k' ? 10 : end[-1] == 'm' ? 20 : 30;
+        end--;
+    }
+    if (start == end) {
+        return 0;
+    }
+    for (c = start; c < end; c++) {
+        if (*c < '0' || *c > '9' || n > (UINT64_MAX - 9) / 10) {
+            return 0;
+        }
+        n = n * 10 + (*c - '0');
+    }
+    if (n > UINT64_MAX >> shift) {
+        return 0;
     }
+    *value = n << shift;
+    return 1;
+}
 
-    size = num * nsize;
-    if (nsize != size / num) {
-        return NULL;
+static void option_warning(const char* start, const char* end) {
+    const char* message = "malloc: ignoring MALLOC_CONF option ";
+
+    write(STDERR_FILENO, message, strlen(message));
+    write(STDERR_FILENO, start, end - start);
+    write(STDERR_FILENO, "\n", 1);
+}
+
+// "name:value,name:value", read once by initialize_memory_pool() before
+// anything uses the options; only walks the environment string in place
+static void options_initialize() {
+    const char* conf = getenv("MALLOC_CONF"), *end, *colon;
+    const option_t* option;
+    uint64_t value;
+
+    for (; conf && *conf; conf = *end ? end + 1 : end) {
+        for (end = conf; *end && *end != ','; end++) {
+        }
+        for (colon = conf; colon < end && *colon != ':'; colon++) {
+        }
+        if (end == conf) {
+            continue;
+        }
+        option = colon < end ? option_find(conf, colon - conf) : NULL;
+        if (!option || !option_parse(colon + 1, end, &value) || value < option->min || value > option->max) {
+            option_warning(conf, end);
+            continue;
+        }
+        *option->value = value;
     }
+}
 
-    block = malloc(size);
-    if (block) {
-        memset(block, 0, size);
+// everything but node 0's first segment, which node_pool() sets up on first
+// use; run by the constructor, and by the entry points that walk the heap in
+// case they are called from an earlier one. Until then malloc and free work
+// without thread caches, straight on node 0's pool under global_malloc_lock.
+static void initialize_memory_pool() {
+    unsigned int i, j, nodes;
+
+    if (__atomic_load_n(&malloc_ready, __ATOMIC_ACQUIRE)) {
+        return;
     }
-    return block;
+    pthread_mutex_lock(&global_malloc_lock);
+    if (!malloc_ready) {
+        options_initialize();
+        nodes = sysfs_count("/sys/devices/system/node/possible", MAX_NUMA_NODES);
+        if (nodes > narenas) {
+            nodes = narenas;
+        }
+        for (i = 0; i < nodes; i++) {
+            node_pools[i].node = i;
+            for (j = 0; j < TCACHE_NUM_CLASSES; j++) {
+                pthread_mutex_init(&central_lists[i][j].lock, NULL);
+            }
+        }
+        num_nodes = nodes;
+        slab_initialize();
+        percpu_initialize();
+        stream_initialize();
+#ifdef SYS_membarrier
+        scavenge_barrier = SCAVENGE_INTERVAL_MS && syscall(SYS_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0, 0) == 0;
+#endif
+        __atomic_store_n(&malloc_ready, 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&global_malloc_lock);
 }
 
-// debugging
-size_t get_allocated_memory() {
-    return global_pool.allocated_memory;
+// the pool a pool block belongs to, from the page map without the heap lock
+static memory_pool_t* home_pool(header_t* header) {
+    return ((segment_t*)pagemap_get(header))->pool;
 }
 
-size_t get_free_memory() {
-    return global_pool.free_memory;
+// what the page map says about a pointer handed to free or realloc, aborting
+// on anything malloc did not hand out: unmapped or foreign pages, misaligned
+// pointers and arena blocks
+static uintptr_t pointer_kind(void* block, const char* message) {
+    uintptr_t kind = pagemap_get(block);
+    memory_pool_t* pool;
+
+    if (!kind || ((uintptr_t)block & (ALIGNMENT - 1))) {
+        invalid_pointer(message);
+    }
+    if (kind != PAGE_SLAB && kind != PAGE_MMAPPED) {
+        pool = ((segment_t*)kind)->pool;
+        if (pool < node_pools || pool >= node_pools + MAX_NUMA_NODES) {
+            invalid_pointer(message);
+        }
+    }
+    return kind;
 }
 
-void print_memory_usage() {
-    printf("Allocated memory: %zu bytes\n", get_allocated_memory());
-    printf("Free memory: %zu bytes\n", get_free_memory());
+// the node's pool, mapping its first segment on first use; caller holds
+// global_malloc_lock
+static memory_pool_t* node_pool(unsigned int node) {
+    memory_pool_t* pool = &node_pools[node];
+
+    if (!pool->current && !(pool->current = segment_bootstrap(pool))
+        && !(pool->current = segment_create(pool, PAGE_ALIGN(segment_size)))) {
+        return &node_pools[0];
+    }
+    return pool;
 }
 
-void print_free_list() {
-    header_t* curr = global_pool.head;
-    printf("Free list:\n");
-    while (curr) {
-        printf("Block at %p, size: %zu\n", (void*)curr, curr->size);
-        curr = curr->next;
+static unsigned int current_node() {
+    unsigned int cpu, node;
+
+    if (num_nodes == 1 || getcpu(&cpu, &node) || node >= num_nodes) {
+        return 0;
     }
+    return node;
 }
 
-void print_pool_status() {
-    printf("Memory pool starts at: %p\n", pool_start);
-    printf("Memory pool ends at: %p\n", (char*)pool_start + POOL_SIZE);
-    printf("Total pool size: %d bytes\n", POOL_SIZE);
+static unsigned int size_to_bin(size_t size) {
+    unsigned int fl;
+
+    if (size < SMALL_BIN_LIMIT) {
+        return size / ALIGNMENT;
+    }
+    fl = 63 - __builtin_clzll(size);
+    return NUM_SMALL_BINS + (fl - SMALL_BIN_SHIFT) * SUB_BINS
+        + ((size >> (fl - SUB_BIN_BITS)) & (SUB_BINS - 1));
+}
+
+// first non-empty bin at or above idx, or -1
+static int find_nonempty_bin(memory_pool_t* pool, unsigned int idx) {
+    unsigned int word;
+    uint64_t bits, summary;
+
+    if (idx >= NUM_BINS) {
+        return -1;
+    }
+    word = idx / 64;
+    bits = pool->bin_bitmap[word] & (~0ULL << (idx % 64));
+    if (!bits) {
+        summary = word + 1 < BITMAP_WORDS ? pool->bin_summary & (~0ULL << (word + 1)) : 0;
+        if (!summary) {
+            return -1;
+        }
+        word = __builtin_ctzll(summary);
+        bits = pool->bin_bitmap[word];
+    }
+    return word * 64 + __builtin_ctzll(bits);
+}
+
+static size_t header_check(header_t* block, size_t value) {
+    if (!HARDENED) {
+        return 0;
+    }
+    return (((uintptr_t)block ^ value ^ heap_secret) * 0x9e3779b97f4a7c15ULL) & ~HEADER_VALUE_MASK;
+}
+
+// size and BLOCK_* flags, without the check
+static size_t header_value(header_t* block) {
+    return block->size & HEADER_VALUE_MASK;
+}
+
+static void header_set(header_t* block, size_t value) {
+    block->size = value | header_check(block, value);
+}
+
+static int header_valid(header_t* block) {
+    return !HARDENED || block->size == (header_value(block) | header_check(block, header_value(block)));
+}
+
+// a header that stopped being one, merged into its neighbour or given back to
+// the bump pointer, so that freeing its block again fails the check
+static void header_clear(header_t* block) {
+    if (HARDENED) {
+        block->size = 0;
+    }
+}
+
+static size_t block_size(header_t* block) {
+    return header_value(block) & ~(size_t)BLOCK_FLAGS;
+}
+
+static void set_block_size(header_t* block, size_t size) {
+    header_set(block, size | (block->size & BLOCK_FLAGS));
+}
+
+static free_links_t* free_links(header_t* block) {
+    return (free_links_t*)(block + 1);
+}
+
+// a large free block keeps, after its links, the time in ms at which its
+// pages were last written, or 0 once they have been purged
+static uint64_t* block_dirty_since(header_t* block) {
+    return (uint64_t*)(free_links(block) + 1);
+}
+
+static uint64_t dirty_since(header_t* block) {
+    return block_size(block) >= PURGE_MIN_SIZE ? *block_dirty_since(block) : 0;
+}
+
+// the whole pages of a free block that hold none of its metadata
+static size_t purge_range(header_t* block, char** start) {
+    char* end = (char*)PAGE_FLOOR((uintptr_t)(block + 1) + block_size(block) - sizeof(size_t));
+
+    *start = (char*)PAGE_ALIGN((uintptr_t)(block_dirty_since(block) + 1));
+    return end > *start ? (size_t)(end - *start) : 0;
+}
+
+// the whole pages between the bump pointer and the highest address used
+static size_t purge_range_top(memory_pool_t* pool, char** start) {
+    char* end = (char*)PAGE_FLOOR((uintptr_t)pool->dirty_end);
+
+    *start = (char*)PAGE_ALIGN((uintptr_t)pool->current->top);
+    return end > *start ? (size_t)(end - *start) : 0;
+}
+
+static uint64_t purge_clock() {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000 + 1; // never 0
+}
+
+// physical neighbours; next_block() returns NULL for the last block before the
+// bump pointer. Retired segments end in an in-use fence, so no segment lookup is needed.
+static header_t* next_block(memory_pool_t* pool, header_t* block) {
+    header_t* next = (header_t*)((char*)(block + 1) + block_size(block));
+    return (char*)next != pool->current->top ? next : NULL;
+}
+
+// only valid when BLOCK_PREV_FREE is set: a free block keeps its size in its last word
+static header_t* prev_block(header_t* block) {
+    size_t prev_size = *((size_t*)block - 1);
+    return (header_t*)((char*)block - prev_size - sizeof(header_t));
+}
+
+// a large block's dirty time must be set before it is added
+static void add_to_free_list(memory_pool_t* pool, header_t* block) {
+    size_t size = block_size(block);
+    char* start;
+    unsigned int idx = size_to_bin(size);
+    header_t* next = next_block(pool, block);
+    free_links_t* links = free_links(block);
+
+    *(size_t*)((char*)(block + 1) + size - sizeof(size_t)) = size;
+    if (next) {
+        header_set(next, header_value(next) | BLOCK_PREV_FREE);
+    }
+    header_set(block, header_value(block) | BLOCK_FREE);
+    links->prev = NULL;
+    links->next = pool->bins[idx];
+    if (links->next) {
+        free_links(links->next)->prev = block;
+    }
+    pool->bins[idx] = block;
+    pool->bin_bitmap[idx / 64] |= 1ULL << (idx % 64);
+    pool->bin_summary |= 1ULL << (idx / 64);
+    pool->free_memory += size;
+    if (dirty_since(block)) {
+        pool->dirty_memory += purge_range(block, &start);
+    }
+}
+
+static void remove_from_free_list(memory_pool_t* pool, header_t* block) {
+    size_t size = block_size(block);
+    unsigned int idx = size_to_bin(size);
+    free_links_t* links = free_links(block);
+    char* start;
+
+    // safe unlinking: both neighbours on the list must point back at us
+    if (HARDENED && ((links->prev ? free_links(links->prev)->next : pool->bins[idx]) != block
+                     || (links->next && free_links(links->next)->prev != block))) {
+        invalid_pointer("malloc(): corrupted free list\n");
+    }
+    if (dirty_since(block)) {
+        pool->dirty_memory -= purge_range(block, &start);
+    }
+
+    if (links->prev) {
+        free_links(links->prev)->next = links->next;
+    } else {
+        pool->bins[idx] = links->next;
+        if (!links->next) {
+            pool->bin_bitmap[idx / 64] &= ~(1ULL << (idx % 64));
+            if (!pool->bin_bitmap[idx / 64]) {
+                pool->bin_summary &= ~(1ULL << (idx / 64));
+            }
+        }
+    }
+    if (links->next) {
+        free_links(links->next)->prev = links->prev;
+    }
+    header_set(block, header_value(block) & ~(size_t)BLOCK_FREE);
+    pool->free_memory -= size;
+}
+
+// good fit: the size's own bin if its head is large enough, otherwise the
+// first block of the next non-empty bin, which always fits
+static header_t* get_free_block(memory_pool_t* pool, size_t size) {
+    unsigned int idx = size_to_bin(size);
+    header_t* block = pool->bins[idx];
+    int bin;
+
+    if (!block || block_size(block) < size) {
+        bin = find_nonempty_bin(pool, idx + 1);
+        if (bin < 0) {
+            return NULL;
+        }
+        block = pool->bins[bin];
+    }
+    remove_from_free_list(pool, block);
+    return block;
+}
+
+// the remainder lies within memory that was free since the given dirty time
+static void split_block(memory_pool_t* pool, header_t* block, size_t size, uint64_t since) {
+    size_t current = block_size(block);
+
+    if (current >= size + sizeof(header_t) + MIN_BLOCK_SIZE) {
+        header_t* new_block = (header_t*)((char*)block + sizeof(header_t) + size);
+        header_set(new_block, current - size - sizeof(header_t));
+        set_block_size(block, size);
+        if (block_size(new_block) >= PURGE_MIN_SIZE) {
+            *block_dirty_since(new_block) = since;
+        }
+        add_to_free_list(pool, new_block);
+    }
+}
+
+// merge a freed block with its free physical neighbours in O(1): the right
+// one through its header, the left one through BLOCK_PREV_FREE and its footer
+static header_t* coalesce_free_blocks(memory_pool_t* pool, header_t* block) {
+    header_t* next = next_block(pool, block);
+    header_t* prev;
+
+    if (next && (next->size & BLOCK_FREE)) {
+        remove_from_free_list(pool, next);
+        set_block_size(block, block_size(block) + block_size(next) + sizeof(header_t));
+        header_clear(next);
+    }
+    if (block->size & BLOCK_PREV_FREE) {
+        prev = prev_block(block);
+        remove_from_free_list(pool, prev);
+        set_block_size(prev, block_size(prev) + block_size(block) + sizeof(header_t));
+        header_clear(block);
+        block = prev;
+    }
+    return block;
+}
+
+// close the current segment and start bump-allocating from a new one that is
+// at least SEGMENT_GROWTH times larger and fits total_size
+static int pool_grow(memory_pool_t* pool, size_t total_size) {
+    segment_t* old = pool->current;
+    segment_t* segment;
+    header_t* tail = NULL, *fence;
+    size_t size, needed, room, granule;
+
+    granule = segment_granule();
+    needed = (SEGMENT_HEADER_SIZE + total_size + sizeof(header_t) + granule - 1) & ~(granule - 1);
+    if (pool->mapped_memory >= MAX_HEAP_SIZE
+        || needed > MAX_HEAP_SIZE - pool->mapped_memory) {
+        return 0;
+    }
+    room = MAX_HEAP_SIZE - pool->mapped_memory;
+    size = old->size * SEGMENT_GROWTH;
+    if (size < PAGE_ALIGN(segment_size)) {
+        size = PAGE_ALIGN(segment_size); // growing out of the bootstrap segment
+    }
+    if (size > room) {
+        size = room & ~(granule - 1);
+    }
+    if (size < needed) {
+        size = needed;
+    }
+    segment = segment_create(pool, size);
+    if (!segment) {
+        return 0;
+    }
+
+    // whatever is left above old->top becomes a free block in front of the fence
+    fence = (header_t*)old->top;
+    if ((size_t)(old->limit - old->top) >= sizeof(header_t) + MIN_BLOCK_SIZE) {
+        tail = (header_t*)old->top;
+        header_set(tail, old->limit - old->top - sizeof(header_t));
+        pool->allocated_memory += old->limit - old->top;
+        fence = (header_t*)old->limit;
+    }
+    header_set(fence, 0);
+    old->top = (char*)fence + sizeof(header_t);
+
+    pool->current = segment;
+    pool->dirty_end = NULL;
+    if (tail) {
+        if (block_size(tail) >= PURGE_MIN_SIZE) {
+            *block_dirty_since(tail) = purge_clock();
+        }
+        add_to_free_list(pool, tail);
+    }
+    return 1;
+}
+
+// pool_malloc() that also tells from where on the payload is known to be zero:
+// only memory carved above a segment's pristine mark is, purged pages may not
+// be as MADV_FREE leaves them alone until the kernel needs them
+static header_t* pool_malloc_fresh(memory_pool_t* pool, size_t size, char** zero_from) {
+    size_t total_size;
+    header_t* header, *next;
+    segment_t* segment;
+
+    size = size < MIN_BLOCK_SIZE ? MIN_BLOCK_SIZE : BLOCK_ALIGN(size);
+    header = get_free_block(pool, size);
+    if (header) {
+        split_block(pool, header, size, dirty_since(header));
+        if ((next = next_block(pool, header))) {
+            header_set(next, header_value(next) & ~(size_t)BLOCK_PREV_FREE);
+        }
+        *zero_from = (char*)(header + 1) + block_size(header);
+        return header;
+    }
+
+    total_size = size + sizeof(header_t);
+    if ((size_t)(pool->current->limit - pool->current->top) < total_size
+        && !pool_grow(pool, total_size)) {
+        return NULL;
+    }
+
+    segment = pool->current;
+    header = (header_t*)segment->top;
+    header_set(header, size); // no BLOCK_PREV_FREE: free blocks never touch the bump pointer
+    *zero_from = segment->pristine > (char*)(header + 1) ? segment->pristine : (char*)(header + 1);
+
+    segment->top += total_size;
+    if (segment->top > segment->pristine) {
+        segment->pristine = segment->top;
+    }
+    pool->allocated_memory += total_size;
+    return header;
+}
+
+// allocate from the shared pool; caller holds global_malloc_lock
+static header_t* pool_malloc(memory_pool_t* pool, size_t size) {
+    char* zero_from;
+
+    return pool_malloc_fresh(pool, size, &zero_from);
+}
+
+// purge what the segment's pages allow of a page-aligned range and return how
+// much that was: huge pages are only purged whole so the kernel never has to
+// split them, and reserved hugetlb pages are kept since a later fault could
+// find none left
+static size_t purge_pages(segment_t* segment, char* start, size_t length) {
+    static int advice = MADV_FREE;
+    char* end = start + length;
+
+    if (segment->huge == HUGE_PAGES_HUGETLB) {
+        return 0;
+    }
+    if (segment->huge == HUGE_PAGES_THP) {
+        start = (char*)HUGE_ALIGN((uintptr_t)start);
+        end = (char*)HUGE_FLOOR((uintptr_t)end);
+        if (end <= start) {
+            return 0;
+        }
+    }
+
+    // MADV_FREE needs Linux 4.5; older kernels reject it
+    if (madvise(start, end - start, advice) && advice == MADV_FREE) {
+        advice = MADV_DONTNEED;
+        madvise(start, end - start, advice);
+    }
+    return end - start;
+}
+
+// purge the free memory that has been dirty for at least the decay time, or
+// all of it when force is set
+static size_t pool_purge(memory_pool_t* pool, uint64_t now, int force) {
+    header_t* block;
+    char* start;
+    size_t length, done, purged = 0;
+    int bin;
+
+    for (bin = find_nonempty_bin(pool, size_to_bin(PURGE_MIN_SIZE)); bin >= 0;
+         bin = find_nonempty_bin(pool, bin + 1)) {
+        for (block = pool->bins[bin]; block; block = free_links(block)->next) {
+            if (!dirty_since(block) || (!force && now - *block_dirty_since(block) < purge_decay_ms)) {
+                continue;
+            }
+            length = purge_range(block, &start);
+            done = purge_pages((segment_t*)pagemap_get(block), start, length);
+            if (!done) {
+                continue; // no whole huge page in it, leave it dirty
+            }
+            *block_dirty_since(block) = 0;
+            pool->dirty_memory -= length;
+            purged += done;
+        }
+        if (bin == NUM_BINS - 1) {
+            break;
+        }
+    }
+
+    if (pool->dirty_end && (force || now - pool->dirty_end_since >= purge_decay_ms)) {
+        length = purge_range_top(pool, &start);
+        done = length ? purge_pages(pool->current, start, length) : 0;
+        if (done || !length) {
+            pool->dirty_end = NULL;
+            purged += done;
+        }
+    }
+
+    pool->purged_memory += purged;
+    pool->next_purge = now + purge_decay_ms;
+    return purged;
+}
+
+// return a block to the shared pool; caller holds global_malloc_lock
+static void pool_free(memory_pool_t* pool, header_t* header) {
+    char* top = pool->current->top;
+    char* start;
+    uint64_t now = 0;
+
+    header = coalesce_free_blocks(pool, header);
+    if (!next_block(pool, header)) {
+        pool->current->top = (char*)header;
+        pool->allocated_memory -= block_size(header) + sizeof(header_t);
+        header_clear(header);
+        if (top > pool->dirty_end) {
+            pool->dirty_end = top;
+        }
+        if (purge_range_top(pool, &start)) {
+            pool->dirty_end_since = now = purge_clock();
+        }
+    } else {
+        if (block_size(header) >= PURGE_MIN_SIZE) {
+            *block_dirty_since(header) = now = purge_clock();
+        }
+        add_to_free_list(pool, header);
+    }
+    if (now && now >= pool->next_purge) {
+        pool_purge(pool, now, 0);
+    }
+}
+
+static size_t* mmap_lead(header_t* header) {
+    return (size_t*)header - 1;
+}
+
+// map a large block whose payload is aligned to alignment; pages that the
+// alignment does not need are unmapped again right away
+static header_t* mmap_malloc(size_t size, size_t alignment) {
+    size_t length = PAGE_ALIGN(size + alignment - ALIGNMENT + MMAP_OVERHEAD);
+    char* start, *payload, *end;
+    size_t trim;
+    header_t* header;
+
+    if (length < size) {
+        return NULL;
+    }
+    start = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
+    if (start == MAP_FAILED) {
+        return NULL;
+    }
+    payload = (char*)(((uintptr_t)start + MMAP_OVERHEAD + alignment - 1) & ~(uintptr_t)(alignment - 1));
+    trim = (size_t)((payload - MMAP_OVERHEAD - start) & ~(uintptr_t)4095);
+    if (trim) {
+        munmap(start, trim);
+        start += trim;
+        length -= trim;
+    }
+    end = (char*)PAGE_ALIGN((uintptr_t)payload + size);
+    if (start + length > end) {
+        munmap(end, start + length - end);
+        length = end - start;
+    }
+
+    if (!pagemap_set(payload, 1, PAGE_MMAPPED)) {
+        munmap(start, length);
+        return NULL;
+    }
+    hardened_initialize();
+    header = (header_t*)payload - 1;
+    *mmap_lead(header) = payload - start;
+    header_set(header, (length - (payload - start)) | BLOCK_MMAPPED);
+    __atomic_fetch_add(&mmapped_memory, length, __ATOMIC_RELAXED);
+    return header;
+}
+
+static void mmap_free(header_t* header) {
+    size_t lead = *mmap_lead(header);
+    size_t length = lead + block_size(header);
+
+    __atomic_fetch_sub(&mmapped_memory, length, __ATOMIC_RELAXED);
+    pagemap_set(header + 1, 1, 0);
+    munmap((char*)(header + 1) - lead, length);
+}
+
+// resize a large block's mapping, moving it if it cannot grow in place. It
+// keeps its slack when shrinking by less than half, and grows by at least
+// MMAP_GROWTH times its length. A move keeps the payload's offset within the
+// page, which is all realloc() promises, and maps and registers the new range
+// before the pages move onto it, so that on failure the block is still where
+// it was.
+static header_t* mmap_realloc(header_t* header, size_t size) {
+    size_t lead = *mmap_lead(header);
+    size_t old_length = lead + block_size(header);
+    size_t length = PAGE_ALIGN(lead + size);
+    char* start = (char*)(header + 1) - lead;
+    char* moved;
+
+    if (length <= old_length && length >= old_length / 2) {
+        return header;
+    }
+    if (length > old_length && old_length * MMAP_GROWTH > length) {
+        length = old_length * MMAP_GROWTH;
+    }
+    if (mremap(start, old_length, length, 0) == MAP_FAILED) {
+        if (length < old_length) {
+            return NULL;
+        }
+        moved = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
+        if (moved == MAP_FAILED) {
+            return NULL;
+        }
+        if (!pagemap_set(moved + lead, 1, PAGE_MMAPPED)) {
+            munmap(moved, length);
+            return NULL;
+        }
+        // unregistered while we still own the page: once the mapping has
+        // moved, another thread may map a block of its own there
+        pagemap_set(header + 1, 1, 0);
+        if (mremap(start, old_length, old_length, MREMAP_MAYMOVE | MREMAP_FIXED, moved) == MAP_FAILED) {
+            pagemap_set(header + 1, 1, PAGE_MMAPPED);
+            pagemap_set(moved + lead, 1, 0);
+            munmap(moved, length);
+            return NULL;
+        }
+        header = (header_t*)(moved + lead) - 1;
+    }
+    header_set(header, (length - lead) | BLOCK_MMAPPED);
+    if (length > old_length) {
+        __atomic_fetch_add(&mmapped_memory, length - old_length, __ATOMIC_RELAXED);
+    } else {
+        __atomic_fetch_sub(&mmapped_memory, old_length - length, __ATOMIC_RELAXED);
+    }
+    return header;
+}
+
+// resize a pool block without moving it: shrink by giving a large enough tail
+// back, grow into a free right neighbour or the unused space above top.
+// Returns 0 if the block has to move. Caller holds global_malloc_lock.
+static int pool_resize(memory_pool_t* pool, header_t* header, size_t size) {
+    segment_t* segment = pool->current;
+    header_t* next = next_block(pool, header);
+    header_t* tail;
+    size_t current = block_size(header);
+    size_t excess;
+    uint64_t since;
+
+    size = size < MIN_BLOCK_SIZE ? MIN_BLOCK_SIZE : BLOCK_ALIGN(size);
+    if (current >= size) {
+        excess = current - size;
+        if (excess >= sizeof(header_t) + MIN_BLOCK_SIZE && excess >= current / 2) {
+            tail = (header_t*)((char*)(header + 1) + size);
+            header_set(tail, excess - sizeof(header_t));
+            set_block_size(header, size);
+            pool_free(pool, tail);
+        }
+        return 1;
+    }
+
+    if (!next) {
+        if ((size_t)(segment->limit - segment->top) < size - current) {
+            return 0;
+        }
+        segment->top += size - current;
+        if (segment->top > segment->pristine) {
+            segment->pristine = segment->top;
+        }
+        pool->allocated_memory += size - current;
+        set_block_size(header, size);
+        return 1;
+    }
+
+    if (!(next->size & BLOCK_FREE) || current + sizeof(header_t) + block_size(next) < size) {
+        return 0;
+    }
+    since = dirty_since(next);
+    remove_from_free_list(pool, next);
+    set_block_size(header, current + sizeof(header_t) + block_size(next));
+    header_clear(next);
+    if ((next = next_block(pool, header))) {
+        header_set(next, header_value(next) & ~(size_t)BLOCK_PREV_FREE);
+    }
+    split_block(pool, header, size, since);
+    return 1;
+}
+
+static int is_slab_object(void* ptr) {
+    return (char*)ptr >= slab_region_start && (char*)ptr < slab_region_end;
+}
+
+static unsigned int slab_node(void* ptr) {
+    return ((char*)ptr - slab_region_start) / SLAB_REGION_SIZE;
+}
+
+static run_t* slab_run(void* ptr) {
+    return (run_t*)((uintptr_t)ptr & ~(uintptr_t)(SLAB_RUN_SIZE - 1));
+}
+
+static size_t slab_class_size(unsigned int size_class) {
+    return (size_class + 1) * ALIGNMENT;
+}
+
+static unsigned int slab_capacity(unsigned int size_class) {
+    return (SLAB_RUN_SIZE - SLAB_RUN_HEADER_SIZE) / slab_class_size(size_class);
+}
+
+static void run_unlink(run_t** list, run_t* run) {
+    if (run->prev) {
+        run->prev->next = run->next;
+    } else {
+        *list = run->next;
+    }
+    if (run->next) {
+        run->next->prev = run->prev;
+    }
+}
+
+static void run_push(run_t** list, run_t* run) {
+    run->prev = NULL;
+    run->next = *list;
+    if (run->next) {
+        run->next->prev = run;
+    }
+    *list = run;
+}
+
+// take an empty run, or a fresh one from the reserved range, for size_class
+static run_t* slab_new_run(slab_heap_t* slabs, unsigned int size_class) {
+    run_t* run = slabs->empty;
+
+    if (run) {
+        run_unlink(&slabs->empty, run);
+    } else {
+        if (slabs->top == slabs->end) {
+            return NULL;
+        }
+        if (slabs->top == slabs->committed) {
+            if (!pagemap_set(slabs->committed, SLAB_COMMIT_SIZE, PAGE_SLAB)
+                || mprotect(slabs->committed, SLAB_COMMIT_SIZE, PROT_READ | PROT_WRITE)) {
+                return NULL;
+            }
+            bind_to_node(slabs->committed, SLAB_COMMIT_SIZE, slabs->node);
+            slabs->committed += SLAB_COMMIT_SIZE;
+            slabs->committed_memory += SLAB_COMMIT_SIZE;
+        }
+        run = (run_t*)slabs->top;
+        slabs->top += SLAB_RUN_SIZE;
+    }
+    run->free_list = NULL;
+    run->carve = (char*)run + SLAB_RUN_HEADER_SIZE;
+    run->owner = NULL;
+    run->size_class = size_class;
+    run->free_count = slab_capacity(size_class);
+    run_push(&slabs->partial[size_class], run);
+    return run;
+}
+
+// caller holds global_malloc_lock; owner, if set, becomes the run's owner
+static void* slab_malloc(slab_heap_t* slabs, unsigned int size_class, remote_free_list_t* owner) {
+    run_t* run = slabs->partial[size_class];
+    void* ptr;
+
+    if (!run && !(run = slab_new_run(slabs, size_class))) {
+        return NULL;
+    }
+    if (owner) {
+        __atomic_store_n(&run->owner, owner, __ATOMIC_RELAXED);
+    }
+    if (run->free_list) {
+        ptr = run->free_list;
+        run->free_list = link_get(ptr);
+    } else {
+        ptr = run->carve;
+        run->carve += slab_class_size(size_class);
+    }
+    if (--run->free_count == 0) {
+        run_unlink(&slabs->partial[size_class], run);
+    }
+    return ptr;
+}
+
+// hardened builds: a slab object must start a slot in the carved part of its
+// run. Checked as objects go back to a run or the central lists, or come off
+// a remote list, rather than when they are freed into a cache.
+static void slab_check_slot(void* ptr, const char* message) {
+    run_t* run = slab_run(ptr);
+
+    if (HARDENED && ((char*)ptr >= run->carve
+                     || (uint32_t)((char*)ptr - (char*)run - SLAB_RUN_HEADER_SIZE) * slab_divisors[run->size_class]
+                            >= slab_divisors[run->size_class])) {
+        invalid_pointer(message);
+    }
+}
+
+// caller holds global_malloc_lock; the run goes back to its own node's heap
+static void slab_free(void* ptr) {
+    slab_heap_t* slabs = &node_slabs[slab_node(ptr)];
+    run_t* run = slab_run(ptr);
+
+    slab_check_slot(ptr, "free(): invalid pointer\n");
+
+    if (run->free_count++ == 0) {
+        run_push(&slabs->partial[run->size_class], run);
+    }
+    if (run->free_count == slab_capacity(run->size_class)) {
+        run_unlink(&slabs->partial[run->size_class], run);
+        run_push(&slabs->empty, run);
+        return;
+    }
+    link_set(ptr, run->free_list);
+    run->free_list = ptr;
+}
+
+// small sizes come from the node's slabs and fall back to pool blocks once
+// the slab range is used up
+static void* small_malloc(unsigned int node, size_t size, remote_free_list_t* owner) {
+    header_t* header;
+    void* ptr;
+
+    if (size <= SLAB_MAX_SIZE && (ptr = slab_malloc(&node_slabs[node], size / ALIGNMENT - 1, owner))) {
+        return ptr;
+    }
+    header = pool_malloc(node_pool(node), size);
+    return header ? (void*)(header + 1) : NULL;
+}
+
+// caller holds global_malloc_lock. Hardened builds check here, under the
+// lock, that the block did not overflow into the header after it.
+static void small_free(void* ptr) {
+    header_t* header = (header_t*)ptr - 1, *next;
+    segment_t* segment;
+
+    if (is_slab_object(ptr)) {
+        slab_free(ptr);
+        return;
+    }
+    if (HARDENED) {
+        segment = (segment_t*)pagemap_get(header);
+        next = (header_t*)((char*)ptr + block_size(header));
+        if ((char*)next < segment->top && !header_valid(next)) {
+            invalid_pointer("free(): corrupted next block header\n");
+        }
+        unmark_freed(ptr); // pool blocks are marked by BLOCK_FREE instead
+    }
+    pool_free(home_pool(header), header);
+}
+
+// a bin holds at most tcache_capacity blocks and tcache_bytes bytes
+static unsigned int tcache_bin_capacity(size_t size) {
+    size_t capacity = tcache_bytes / size;
+    if (capacity < 2) {
+        return 2;
+    }
+    return capacity > tcache_capacity ? (unsigned int)tcache_capacity : (unsigned int)capacity;
+}
+
+// whether block may be cached for node: a block must go back to its home
+// node's heap
+static int node_accepts(unsigned int node, void* block) {
+    if (num_nodes == 1) {
+        return 1;
+    }
+    if (is_slab_object(block)) {
+        return slab_node(block) == node;
+    }
+    return home_pool((header_t*)block - 1)->node == (int)node;
+}
+
+static central_list_t* central_list(unsigned int node, size_t size) {
+    return &central_lists[node][size / ALIGNMENT - 1];
+}
+
+// move up to count blocks of the node's size class from the list at *head
+// into the central list, and the rest back to the heap
+static void central_put(unsigned int node, size_t size, void** head, unsigned int* count) {
+    central_list_t* central = central_list(node, size);
+    unsigned int capacity = tcache_bin_capacity(size) * CENTRAL_CAPACITY_FACTOR;
+    void* ptr;
+
+    timed_lock(&central->lock);
+    while (*count && *head && central->count < capacity && node_accepts(node, *head)) {
+        ptr = *head;
+        if (HARDENED && is_slab_object(ptr)) {
+            slab_check_slot(ptr, "free(): invalid pointer\n");
+        }
+        *head = link_get(ptr);
+        link_set(ptr, central->head);
+        central->head = ptr;
+        central->count++;
+        (*count)--;
+    }
+    pthread_mutex_unlock(&central->lock);
+
+    if (!*count || !*head) {
+        return;
+    }
+    timed_lock(&global_malloc_lock);
+    while (*count && *head) {
+        ptr = *head;
+        *head = link_get(ptr);
+        small_free(ptr);
+        (*count)--;
+    }
+    pthread_mutex_unlock(&global_malloc_lock);
+}
+
+// take up to count blocks off the node's central list for size onto *head;
+// returns how many it got
+static unsigned int central_take(unsigned int node, size_t size, void** head, unsigned int count) {
+    central_list_t* central = central_list(node, size);
+    unsigned int taken = 0;
+    void* ptr;
+
+    if (!__atomic_load_n(&central->head, __ATOMIC_RELAXED)) {
+        return 0;
+    }
+    timed_lock(&central->lock);
+    while (taken < count && central->head) {
+        ptr = central->head;
+        central->head = link_get(ptr);
+        central->count--;
+        link_set(ptr, *head);
+        *head = ptr;
+        taken++;
+    }
+    pthread_mutex_unlock(&central->lock);
+    return taken;
+}
+
+// until the scavenger has taken our bins
+static __attribute__((noinline, cold)) void tcache_wait(thread_cache_t* cache) {
+    while (__atomic_load_n(&cache->scavenging, __ATOMIC_ACQUIRE)) {
+        sched_yield();
+    }
+}
+
+// bracket every use of the calling thread's bins. The scavenger raises
+// scavenging, runs a membarrier and then reads seq, so either it sees the odd
+// seq or we see its flag here: no fence is needed on our side.
+static inline void tcache_enter(thread_cache_t* cache) {
+    if (!SCAVENGE_INTERVAL_MS) {
+        return;
+    }
+    __atomic_store_n(&cache->seq, cache->seq + 1, __ATOMIC_RELAXED);
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    if (__builtin_expect(__atomic_load_n(&cache->scavenging, __ATOMIC_ACQUIRE), 0)) {
+        tcache_wait(cache);
+    }
+}
+
+static inline void tcache_leave(thread_cache_t* cache) {
+    if (SCAVENGE_INTERVAL_MS) {
+        __atomic_store_n(&cache->seq, cache->seq + 1, __ATOMIC_RELEASE);
+    }
+}
+
+static void tcache_scavenge(int force);
+
+static void tcache_flush(thread_cache_t* cache, tcache_bin_t* bin, size_t size, unsigned int count) {
+    unsigned int left = count;
+
+    if (cache->stats) {
+        stat_add(cache->stats, &cache->stats->slow_frees, 1);
+    }
+    central_put(cache->node, size, &bin->head, &left);
+    bin->count -= count - left;
+}
+
+// cache a block of at least size bytes, spilling half the bin when it is full
+static void tcache_put(thread_cache_t* cache, void* block, size_t size) {
+    tcache_bin_t* bin = &cache->bins[size / ALIGNMENT - 1];
+
+    link_set(block, bin->head);
+    bin->head = block;
+    if (++bin->count > tcache_bin_capacity(size)) {
+        tcache_flush(cache, bin, size, bin->count / 2);
+    }
+}
+
+// refill from the central list, and only carve new blocks from the heap when
+// it has none
+static void tcache_refill(thread_cache_t* cache, tcache_bin_t* bin, size_t size) {
+    void* ptr;
+    unsigned int i, batch;
+
+    batch = tcache_bin_capacity(size) / 2;
+    cache->node = current_node();
+    if (cache->stats) {
+        stat_add(cache->stats, &cache->stats->slow_allocs, 1);
+    }
+    if ((i = central_take(cache->node, size, &bin->head, batch))) {
+        bin->count += i;
+        return;
+    }
+    if (scavenge_interval_ms && purge_clock() >= __atomic_load_n(&next_scavenge, __ATOMIC_RELAXED)) {
+        tcache_scavenge(0);
+        if ((i = central_take(cache->node, size, &bin->head, batch))) {
+            bin->count += i;
+            return;
+        }
+    }
+    timed_lock(&global_malloc_lock);
+    for (i = 0; i < batch; i++) {
+        ptr = small_malloc(cache->node, size, cache->remote);
+        if (!ptr) {
+            break;
+        }
+        link_set(ptr, bin->head);
+        bin->head = ptr;
+        bin->count++;
+    }
+    pthread_mutex_unlock(&global_malloc_lock);
+}
+
+// zeroed, never freed per-thread metadata; caller holds global_malloc_lock
+static void* chunk_alloc(size_t size) {
+    void* chunk;
+
+    size = ALIGN(size);
+    if ((size_t)(remote_chunk_end - remote_chunk_top) < size) {
+        chunk = mmap(NULL, REMOTE_CHUNK_SIZE, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
+        if (chunk == MAP_FAILED) {
+            return NULL;
+        }
+        remote_chunk_top = chunk;
+        remote_chunk_end = remote_chunk_top + REMOTE_CHUNK_SIZE;
+    }
+    chunk = remote_chunk_top;
+    remote_chunk_top += size;
+    return chunk;
+}
+
+// caller holds global_malloc_lock
+static remote_free_list_t* remote_list_create() {
+    remote_free_list_t* list = unused_remote_lists;
+
+    if (list) {
+        unused_remote_lists = list->next_unused;
+    } else if (!(list = chunk_alloc(sizeof(remote_free_list_t)))) {
+        return NULL;
+    }
+    __atomic_store_n(&list->head, NULL, __ATOMIC_RELEASE);
+    return list;
+}
+
+// caller holds global_malloc_lock; readers walk all_thread_stats without it
+static thread_stats_t* thread_stats_create() {
+    thread_stats_t* stats = unused_thread_stats;
+
+    if (stats) {
+        unused_thread_stats = stats->next_unused;
+        return stats;
+    }
+    if (!(stats = chunk_alloc(sizeof(thread_stats_t)))) {
+        return NULL;
+    }
+    stats->next = all_thread_stats;
+    __atomic_store_n(&all_thread_stats, stats, __ATOMIC_RELEASE);
+    return stats;
+}
+
+// push a slab object onto its owner's list with a single CAS; fails once the owner has exited
+static int remote_free(remote_free_list_t* list, void* ptr) {
+    void* head = __atomic_load_n(&list->head, __ATOMIC_RELAXED);
+
+    do {
+        if (head == REMOTE_CLOSED) {
+            return 0;
+        }
+        link_set(ptr, head);
+    } while (!__atomic_compare_exchange_n(&list->head, &head, ptr, 1,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    return 1;
+}
+
+// move everything other threads freed back to us into our own bins
+static void tcache_drain_remote(thread_cache_t* cache) {
+    void* ptr, *next;
+
+    if (!cache->remote || !__atomic_load_n(&cache->remote->head, __ATOMIC_RELAXED)) {
+        return;
+    }
+    ptr = __atomic_exchange_n(&cache->remote->head, NULL, __ATOMIC_ACQUIRE);
+    while (ptr) {
+        next = link_get(ptr);
+        slab_check_slot(ptr, "free(): invalid pointer\n");
+        tcache_put(cache, ptr, slab_class_size(slab_run(ptr)->size_class));
+        ptr = next;
+    }
+}
+
+// give the blocks other threads freed back to an idle owner to the heap, so
+// they no longer wait for it to allocate again
+static void remote_list_scavenge(remote_free_list_t* list) {
+    void* ptr, *next;
+
+    if (!list || !__atomic_load_n(&list->head, __ATOMIC_RELAXED)) {
+        return;
+    }
+    ptr = __atomic_exchange_n(&list->head, NULL, __ATOMIC_ACQUIRE);
+    timed_lock(&global_malloc_lock);
+    while (ptr) {
+        next = link_get(ptr);
+        slab_free(ptr);
+        scavenged_blocks++;
+        ptr = next;
+    }
+    pthread_mutex_unlock(&global_malloc_lock);
+}
+
+// take the bins of every other thread cache unused since the last pass, or of
+// all of them that are not in use right now when force is set, and move them
+// to the central lists
+static void tcache_scavenge(int force) {
+    tcache_bin_t bins[TCACHE_NUM_CLASSES];
+    thread_cache_t* cache;
+    unsigned int seq, i;
+
+    if (pthread_mutex_trylock(&scavenge_lock) != 0) {
+        return; // someone else is at it
+    }
+    if (!force && purge_clock() < next_scavenge) {
+        pthread_mutex_unlock(&scavenge_lock);
+        return;
+    }
+    for (cache = all_thread_caches; cache; cache = cache->next) {
+        seq = __atomic_load_n(&cache->seq, __ATOMIC_RELAXED);
+        if (cache == &thread_cache || (seq & 1) || (!force && (seq != cache->seen_seq || cache->swept))) {
+            cache->swept &= seq == cache->seen_seq;
+            cache->seen_seq = seq;
+            continue;
+        }
+        remote_list_scavenge(cache->remote);
+        if (!scavenge_barrier) {
+            continue;
+        }
+        __atomic_store_n(&cache->scavenging, 1, __ATOMIC_RELAXED);
+        syscall(SYS_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0, 0);
+        if (__atomic_load_n(&cache->seq, __ATOMIC_ACQUIRE) != seq) {
+            __atomic_store_n(&cache->scavenging, 0, __ATOMIC_RELEASE);
+            continue;
+        }
+        memcpy(bins, cache->bins, sizeof(bins));
+        memset(cache->bins, 0, sizeof(cache->bins));
+        __atomic_store_n(&cache->scavenging, 0, __ATOMIC_RELEASE);
+        cache->seen_seq = seq;
+        cache->swept = 1;
+
+        for (i = 0; i < TCACHE_NUM_CLASSES; i++) {
+            if (bins[i].head) {
+                scavenged_blocks += bins[i].count;
+                central_put(cache->node, (i + 1) * ALIGNMENT, &bins[i].head, &bins[i].count);
+            }
+        }
+    }
+    __atomic_store_n(&next_scavenge, purge_clock() + scavenge_interval_ms, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&scavenge_lock);
+}
+
+// hand everything a cache holds back to the pool, its bins only when flush is
+// set, and recycle its remote list and statistics; the cache must already be
+// off all_thread_caches
+static void tcache_release(thread_cache_t* cache, int flush) {
+    void* ptr, *next;
+    int i;
+
+    cache->state = -1;
+    for (i = 0; flush && i < TCACHE_NUM_CLASSES; i++) {
+        if (cache->bins[i].head) {
+            tcache_flush(cache, &cache->bins[i], (i + 1) * ALIGNMENT, cache->bins[i].count);
+        }
+    }
+    if (cache->remote) {
+        ptr = __atomic_exchange_n(&cache->remote->head, REMOTE_CLOSED, __ATOMIC_ACQUIRE);
+        timed_lock(&global_malloc_lock);
+        while (ptr) {
+            next = link_get(ptr);
+            slab_free(ptr);
+            ptr = next;
+        }
+        cache->remote->next_unused = unused_remote_lists;
+        unused_remote_lists = cache->remote;
+        pthread_mutex_unlock(&global_malloc_lock);
+        cache->remote = NULL;
+    }
+    if (cache->stats) {
+        timed_lock(&global_malloc_lock);
+        cache->stats->next_unused = unused_thread_stats;
+        unused_thread_stats = cache->stats;
+        pthread_mutex_unlock(&global_malloc_lock);
+        cache->stats = NULL;
+    }
+}
+
+// pthread_key destructor: hand everything cached by an exiting thread back to the pool
+static void tcache_destroy(void* arg) {
+    thread_cache_t* cache = (thread_cache_t*)arg;
+
+    // out of the scavenger's sight before the bins change for the last time
+    pthread_mutex_lock(&scavenge_lock);
+    if (cache->prev) {
+        cache->prev->next = cache->next;
+    } else {
+        all_thread_caches = cache->next;
+    }
+    if (cache->next) {
+        cache->next->prev = cache->prev;
+    }
+    pthread_mutex_unlock(&scavenge_lock);
+    tcache_release(cache, 1);
+}
+
+static void create_thread_cache_key() {
+    pthread_key_create(&thread_cache_key, tcache_destroy);
+}
+
+// returns the calling thread's cache, or NULL once it has been torn down or
+// while the allocator is not fully initialized
+static thread_cache_t* get_thread_cache() {
+    if (thread_cache.state == 0) {
+        if (!__atomic_load_n(&malloc_ready, __ATOMIC_ACQUIRE)) {
+            return NULL;
+        }
+        pthread_once(&thread_cache_key_created, create_thread_cache_key);
+        thread_cache.state = 1;
+        pthread_setspecific(thread_cache_key, &thread_cache);
+        timed_lock(&global_malloc_lock);
+        thread_cache.remote = remote_list_create();
+        thread_cache.stats = thread_stats_create();
+        thread_cache.node = current_node();
+        pthread_mutex_unlock(&global_malloc_lock);
+        pthread_mutex_lock(&scavenge_lock);
+        thread_cache.next = all_thread_caches;
+        if (all_thread_caches) {
+            all_thread_caches->prev = &thread_cache;
+        }
+        all_thread_caches = &thread_cache;
+        pthread_mutex_unlock(&scavenge_lock);
+    }
+    return thread_cache.state > 0 ? &thread_cache : NULL;
+}
+
+#ifdef HAVE_RSEQ
+static struct rseq* rseq_area() {
+    return (struct rseq*)((char*)__builtin_thread_pointer() + __rseq_offset);
+}
+
+// pop from the calling CPU's bin at base, or NULL if it is empty or the
+// critical section was aborted by preemption, migration or a signal
+static void* percpu_pop(percpu_bin_t* base) {
+    void* ptr;
+
+    __asm__ __volatile__(
+        ".pushsection __rseq_cs, \"aw\"\n"
+        ".balign 32\n"
+        "3:\n"
+        ".long 0, 0\n"
+        ".quad 1f, 2f - 1f, 4f\n"
+        ".popsection\n"
+        "leaq 3b(%%rip), %%rax\n"
+        "movq %%rax, 8(%[rseq])\n"
+        "1:\n"
+        "movl (%[rseq]), %%eax\n"          // cpu_id_start
+        "cmpl %[cpus], %%eax\n"
+        "jae 5f\n"
+        "imulq %[stride], %%rax, %%rax\n"
+        "addq %[base], %%rax\n"
+        "movq (%%rax), %%rdx\n"
+        "testq %%rdx, %%rdx\n"
+        "jz 5f\n"
+        "movq (%%rax, %%rdx, 8), %[ptr]\n" // slots[count - 1]
+        "decq %%rdx\n"
+        "movq %%rdx, (%%rax)\n"            // commit
+        "2:\n"
+        "jmp 6f\n"
+        ".pushsection __rseq_failure, \"ax\"\n"
+        ".byte 0x0f, 0xb9, 0x3d\n"
+        ".long 0x53053053\n"               // RSEQ_SIG
+        "4:\n"
+        "jmp 5f\n"
+        ".popsection\n"
+        "5:\n"
+        "xorl %k[ptr], %k[ptr]\n"
+        "6:\n"
+        : [ptr] "=&r"(ptr)
+        : [rseq] "r"(rseq_area()), [base] "r"(base), [cpus] "r"(num_cpus),
+          [stride] "i"(sizeof(percpu_cache_t))
+        : "rax", "rdx", "memory", "cc");
+    return ptr;
+}
+
+// push onto the calling CPU's bin at base; 0 if it holds capacity blocks
+// already or the critical section was aborted
+static int percpu_push(percpu_bin_t* base, void* ptr, size_t capacity) {
+    int pushed;
+
+    __asm__ __volatile__(
+        ".pushsection __rseq_cs, \"aw\"\n"
+        ".balign 32\n"
+        "3:\n"
+        ".long 0, 0\n"
+        ".quad 1f, 2f - 1f, 4f\n"
+        ".popsection\n"
+        "leaq 3b(%%rip), %%rax\n"
+        "movq %%rax, 8(%[rseq])\n"
+        "1:\n"
+        "movl (%[rseq]), %%eax\n"
+        "cmpl %[cpus], %%eax\n"
+        "jae 5f\n"
+        "imulq %[stride], %%rax, %%rax\n"
+        "addq %[base], %%rax\n"
+        "movq (%%rax), %%rdx\n"
+        "cmpq %[capacity], %%rdx\n"
+        "jae 5f\n"
+        "movq %[ptr], 8(%%rax, %%rdx, 8)\n" // slots[count]
+        "incq %%rdx\n"
+        "movq %%rdx, (%%rax)\n"             // commit
+        "2:\n"
+        "movl $1, %[pushed]\n"
+        "jmp 6f\n"
+        ".pushsection __rseq_failure, \"ax\"\n"
+        ".byte 0x0f, 0xb9, 0x3d\n"
+        ".long 0x53053053\n"
+        "4:\n"
+        "jmp 5f\n"
+        ".popsection\n"
+        "5:\n"
+        "xorl %[pushed], %[pushed]\n"
+        "6:\n"
+        : [pushed] "=&r"(pushed)
+        : [rseq] "r"(rseq_area()), [base] "r"(base), [cpus] "r"(num_cpus),
+          [stride] "i"(sizeof(percpu_cache_t)), [ptr] "r"(ptr), [capacity] "r"(capacity)
+        : "rax", "rdx", "memory", "cc");
+    return pushed;
+}
+
+// hand what every CPU's bins hold to the central lists. Only code running on
+// a CPU may touch its bins, so the calling thread moves onto each CPU in turn
+// and pops them there, then goes back to the CPUs it was allowed before.
+static void percpu_drain() {
+    cpu_set_t allowed, one;
+    unsigned int cpu, i, n;
+    void* head, *ptr;
+
+    if (!percpu_caches || sched_getaffinity(0, sizeof(allowed), &allowed)) {
+        return;
+    }
+    for (cpu = 0; cpu < num_cpus; cpu++) {
+        CPU_ZERO(&one);
+        CPU_SET(cpu, &one);
+        if (sched_setaffinity(0, sizeof(one), &one)) {
+            continue; // not a CPU this process may run on
+        }
+        for (i = 0; i < TCACHE_NUM_CLASSES; i++) {
+            head = NULL;
+            n = 0;
+            // a pop fails when preempted, retry while the bin is not empty
+            while (rseq_area()->cpu_id == cpu
+                   && __atomic_load_n(&percpu_caches[cpu].bins[i].count, __ATOMIC_RELAXED)) {
+                if ((ptr = percpu_pop(&percpu_caches->bins[i]))) {
+                    link_set(ptr, head);
+                    head = ptr;
+                    n++;
+                }
+            }
+            if (head) {
+                central_put(0, (i + 1) * ALIGNMENT, &head, &n);
+            }
+        }
+    }
+    sched_setaffinity(0, sizeof(allowed), &allowed);
+}
+
+static void percpu_initialize() {
+    if (!PERCPU_CACHES || num_nodes > 1 || __rseq_size == 0 || (int)rseq_area()->cpu_id < 0) {
+        return;
+    }
+    num_cpus = sysfs_count("/sys/devices/system/cpu/possible", MAX_CPUS);
+    percpu_caches = mmap(NULL, PAGE_ALIGN(sizeof(percpu_cache_t) * num_cpus), PROT_READ | PROT_WRITE,
+                         MAP_ANON | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+    if (percpu_caches == MAP_FAILED) {
+        percpu_caches = NULL;
+    }
+}
+#else
+static void* percpu_pop(percpu_bin_t* base) {
+    (void)base;
+    return NULL;
+}
+
+static int percpu_push(percpu_bin_t* base, void* ptr, size_t capacity) {
+    (void)base, (void)ptr, (void)capacity;
+    return 0;
+}
+
+static void percpu_drain() {
+}
+
+static void percpu_initialize() {
+}
+#endif
+
+// the bins of size's class, for indexing by CPU inside the critical sections
+static percpu_bin_t* percpu_base(size_t size) {
+    return &percpu_caches->bins[size / ALIGNMENT - 1];
+}
+
+// slow path of a per-CPU allocation: take half a bin from the central list,
+// or carve it under the heap lock, keep one block and push the rest onto
+// whatever CPU we now run on
+static void* percpu_refill(size_t size) {
+    unsigned int capacity = tcache_bin_capacity(size);
+    unsigned int n = capacity / 2 + 1;
+    void* head = NULL, *ptr, *next;
+
+    stat_add(thread_stats(), &thread_stats()->slow_allocs, 1);
+    if (!central_take(0, size, &head, n)) {
+        timed_lock(&global_malloc_lock);
+        while (n-- && (ptr = small_malloc(0, size, NULL))) {
+            link_set(ptr, head);
+            head = ptr;
+        }
+        pthread_mutex_unlock(&global_malloc_lock);
+    }
+    if (!(ptr = head)) {
+        return NULL;
+    }
+    // read the link first: once pushed, a block may be popped on another thread
+    for (head = link_get(ptr); head; head = next) {
+        next = link_get(head);
+        if (!percpu_push(percpu_base(size), head, capacity)) {
+            break;
+        }
+    }
+    if (head) {
+        n = capacity;
+        central_put(0, size, &head, &n);
+    }
+    return ptr;
+}
+
+// cache a block of at least size bytes on the calling CPU, moving half of a
+// full bin to the central list first
+static void percpu_free(void* block, size_t size) {
+    unsigned int capacity = tcache_bin_capacity(size);
+    unsigned int n = 1;
+    void* head = block, *ptr;
+
+    if (percpu_push(percpu_base(size), block, capacity)) {
+        return;
+    }
+    stat_add(thread_stats(), &thread_stats()->slow_frees, 1);
+    link_set(block, NULL);
+    while (n < capacity / 2 + 1 && (ptr = percpu_pop(percpu_base(size)))) {
+        link_set(ptr, head);
+        head = ptr;
+        n++;
+    }
+    central_put(0, size, &head, &n);
+}
+
+// heap profiler: roughly one allocation per profile_rate bytes is sampled,
+// the gaps between samples drawn from an exponential distribution so that
+// every byte is equally likely to be picked. A sample records the block and
+// the call stack that allocated it until the block is freed.
+static double sample_log(uint64_t x) {
+    unsigned int e = 63 - __builtin_clzll(x);
+    double m = (double)x / (double)((uint64_t)1 << e);
+    double z = (m - 1) / (m + 1), z2 = z * z;
+
+    // ln x = e ln 2 + ln m, with ln m = 2 atanh(z) and m in [1, 2)
+    return e * 0.6931471805599453 + 2 * z * (1 + z2 * (1.0 / 3 + z2 * (1.0 / 5 + z2 * (1.0 / 7))));
+}
+
+static int64_t sample_interval(thread_cache_t* cache) {
+    uint64_t x = cache->sample_seed;
+    double gap;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    cache->sample_seed = x;
+    // -ln(u) for u uniform in (0, 1], from 53 random bits
+    gap = 53 * 0.6931471805599453 - sample_log(((x * 2685821657736338717ULL) >> 11) | 1);
+    return (int64_t)(gap * __atomic_load_n(&profile_rate, __ATOMIC_RELAXED)) + 1;
+}
+
+static sample_t** sample_bucket(void* ptr) {
+    return &sample_buckets[((uintptr_t)ptr >> 4) * 11400714819323198485ULL >> (64 - PROFILE_BUCKET_BITS)];
+}
+
+static int profile_write_locked(int fd);
+
+// slow path of a malloc whose countdown ran out; takes no allocator lock, so
+// the unwinder may allocate (it is not sampled then)
+static void profile_sample(void* ptr, size_t size) {
+    thread_cache_t* cache = &thread_cache;
+    void* stack[PROFILE_MAX_DEPTH + 1];
+    sample_t** bucket, *sample;
+    int depth, i;
+
+    if (!cache->sample_seed) {
+        // first sample of the thread: only start its countdown
+        cache->sample_seed = ((uintptr_t)cache ^ (uint64_t)purge_clock() << 32) | 1;
+        cache->sample_countdown = sample_interval(cache);
+        return;
+    }
+    cache->sample_countdown = sample_interval(cache);
+    if (cache->in_profiler) {
+        return;
+    }
+    cache->in_profiler = 1;
+    depth = backtrace(stack, PROFILE_MAX_DEPTH + 1) - 1; // without this frame
+
+    pthread_mutex_lock(&profile_lock);
+    if (!unused_samples) {
+        sample = mmap(NULL, REMOTE_CHUNK_SIZE, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
+        for (i = 0; sample != MAP_FAILED && i < (int)(REMOTE_CHUNK_SIZE / sizeof(sample_t)); i++) {
+            sample[i].next = unused_samples;
+            unused_samples = &sample[i];
+        }
+    }
+    if ((sample = unused_samples)) {
+        unused_samples = sample->next;
+        sample->ptr = ptr;
+        sample->size = size;
+        sample->depth = depth > 0 ? depth : 0;
+        memcpy(sample->stack, stack + 1, sample->depth * sizeof(void*));
+        bucket = sample_bucket(ptr);
+        sample->next = *bucket;
+        __atomic_store_n(bucket, sample, __ATOMIC_RELAXED);
+        live_samples++;
+        sampled_allocs++;
+        sampled_bytes += size;
+    }
+    pthread_mutex_unlock(&profile_lock);
+    cache->in_profiler = 0;
+}
+
+// take the sample of a block off its bucket, if it has one; caller holds
+// profile_lock
+static sample_t* profile_unlink_locked(void* ptr) {
+    sample_t** link, *sample;
+
+    for (link = sample_bucket(ptr); (sample = *link); link = &sample->next) {
+        if (sample->ptr == ptr) {
+            __atomic_store_n(link, sample->next, __ATOMIC_RELAXED);
+            break;
+        }
+    }
+    return sample;
+}
+
+// drop the sample of a block being freed, if it has one; only looks inside
+// the lock when the block's bucket is non-empty
+static void profile_forget(void* ptr) {
+    sample_t* sample;
+
+    if (!__atomic_load_n(sample_bucket(ptr), __ATOMIC_RELAXED)) {
+        return;
+    }
+    pthread_mutex_lock(&profile_lock);
+    if ((sample = profile_unlink_locked(ptr))) {
+        sample->next = unused_samples;
+        unused_samples = sample;
+        live_samples--;
+    }
+    pthread_mutex_unlock(&profile_lock);
+}
+
+// the same for a block that may move, keeping the sample for profile_put()
+static sample_t* profile_take(void* ptr) {
+    sample_t* sample;
+
+    if (!__atomic_load_n(sample_bucket(ptr), __ATOMIC_RELAXED)) {
+        return NULL;
+    }
+    pthread_mutex_lock(&profile_lock);
+    sample = profile_unlink_locked(ptr);
+    pthread_mutex_unlock(&profile_lock);
+    return sample;
+}
+
+// give a sample taken off for a block that moved back to it, at ptr
+static void profile_put(sample_t* sample, void* ptr) {
+    sample_t** bucket = sample_bucket(ptr);
+
+    pthread_mutex_lock(&profile_lock);
+    sample->ptr = ptr;
+    sample->next = *bucket;
+    __atomic_store_n(bucket, sample, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&profile_lock);
+}
+
+// write the dump a profile signal asked for, outside the handler; not while
+// the thread is in the profiler, whose unwinder may allocate under the lock
+static void profile_dump_signalled() {
+    int fd;
+
+    if (thread_cache.in_profiler) {
+        return;
+    }
+    pthread_mutex_lock(&profile_lock);
+    if (profile_dump_pending && profile_path[0]) {
+        profile_dump_pending = 0;
+        if ((fd = open(profile_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) >= 0) {
+            profile_write_locked(fd);
+            close(fd);
+        }
+    }
+    pthread_mutex_unlock(&profile_lock);
+}
+
+// the size a block counts as in the statistics, the same when it is allocated
+// and freed: a slab object's class, which size is for it, or a pool or mapped
+// block's payload less the header's share of ALIGNMENT, which can be more than
+// its request
+static size_t block_stat_size(void* ptr, size_t size) {
+    return is_slab_object(ptr) ? size : block_size((header_t*)ptr - 1) & ~(size_t)(ALIGNMENT - 1);
+}
+
+// a block resized in place counts as freed at its old size and allocated at
+// its new one, as it would have been had it moved
+static void stat_resize(size_t old_size, size_t new_size) {
+    if (old_size != new_size) {
+        stat_blocks(old_size, 1, 1);
+        stat_blocks(new_size, 1, 0);
+    }
+}
+
+// the end of every malloc: errno, statistics and profile sampling
+static void* malloc_done(void* ptr, size_t size) {
+    if (!ptr) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    unmark_freed(ptr);
+    stat_blocks(block_stat_size(ptr, size), 1, 0);
+    if (profile_rate && (thread_cache.sample_countdown -= size) < 0) {
+        profile_sample(ptr, size);
+    }
+    if (profile_dump_pending) {
+        profile_dump_signalled();
+    }
+    return ptr;
+}
+
+void* malloc(size_t size) {
+    header_t* header;
+    thread_cache_t* cache;
+    tcache_bin_t* bin;
+    unsigned int node;
+    void* ptr;
+
+    if (size > PTRDIFF_MAX) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    // like glibc, malloc(0) returns a unique pointer rather than NULL
+    size = size ? ALIGN(size) : ALIGNMENT;
+    if (size <= TCACHE_MAX_SIZE && percpu_caches) {
+        if (!(ptr = percpu_pop(percpu_base(size)))) {
+            ptr = percpu_refill(size);
+        }
+    } else if (size <= TCACHE_MAX_SIZE && (cache = get_thread_cache())) {
+        tcache_enter(cache);
+        bin = &cache->bins[size / ALIGNMENT - 1];
+        if (!bin->head) {
+            tcache_drain_remote(cache);
+        }
+        if (!bin->head) {
+            tcache_refill(cache, bin, size);
+        }
+        ptr = bin->head;
+        if (ptr) {
+            bin->head = link_get(ptr);
+            bin->count--;
+        }
+        tcache_leave(cache);
+    } else if (size >= mmap_threshold) {
+        header = mmap_malloc(size, ALIGNMENT);
+        ptr = header ? (void*)(header + 1) : NULL;
+    } else if (size <= SLAB_MAX_SIZE) {
+        node = current_node();
+        timed_lock(&global_malloc_lock);
+        ptr = small_malloc(node, size, NULL);
+        pthread_mutex_unlock(&global_malloc_lock);
+    } else {
+        node = current_node();
+        timed_lock(&global_malloc_lock);
+        header = pool_malloc(node_pool(node), size);
+        pthread_mutex_unlock(&global_malloc_lock);
+        ptr = header ? (void*)(header + 1) : NULL;
+    }
+    return malloc_done(ptr, size);
+}
+
+// hardened builds: what pointer_kind() cannot see from the page map alone,
+// pointers into the middle of a block, headers that were overwritten, and
+// blocks that were freed already. Frees leave the slot check of slab objects
+// to slab_check_slot() once they leave the caches, where it is off the fast
+// path. Inline as it is on every free.
+static inline void hardened_check(void* block, uintptr_t kind, int slot, const char* invalid, const char* freed) {
+    header_t* header = (header_t*)block - 1;
+
+    if (kind == PAGE_SLAB) {
+        if (slot) {
+            slab_check_slot(block, invalid);
+        }
+    } else if (!header_valid(header)) {
+        invalid_pointer(invalid);
+    }
+    if ((kind != PAGE_SLAB && (header->size & BLOCK_FREE)) || ((uintptr_t*)block)[1] == free_key(block)) {
+        invalid_pointer(freed);
+    }
+}
+
+void* realloc(void* block, size_t size) {
+    header_t* header;
+    sample_t* sample;
+    uintptr_t kind;
+    void* ret;
+    size_t usable, old_size;
+    int resized;
+
+    if (!block) {
+        return malloc(size);
+    }
+    if (size == 0) {
+        free(block);
+        return NULL;
+    }
+
+    if (size > PTRDIFF_MAX) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    size = ALIGN(size);
+    kind = pointer_kind(block, "realloc(): invalid pointer\n");
+    if (HARDENED) {
+        hardened_check(block, kind, 1, "realloc(): invalid pointer\n", "realloc(): block was freed\n");
+    }
+    if (kind == PAGE_SLAB) {
+        usable = slab_class_size(slab_run(block)->size_class);
+        if (size <= usable) {
+            return block;
+        }
+        ret = malloc(size);
+        if (ret) {
+            block_copy(ret, block, usable);
+            free(block);
+        }
+        return ret;
+    }
+
+    header = (header_t*)block - 1;
+    old_size = block_stat_size(block, 0);
+    if (kind == PAGE_MMAPPED) {
+        if (size >= mmap_threshold) {
+            // off its bucket while the mapping may move, so that a free of
+            // whatever is mapped at the old address next cannot drop it
+            sample = live_samples ? profile_take(block) : NULL;
+            header = mmap_realloc(header, size);
+            if (sample) {
+                profile_put(sample, header ? (void*)(header + 1) : block);
+            }
+            if (!header) {
+                return NULL;
+            }
+            stat_resize(old_size, block_stat_size(header + 1, 0));
+            return header + 1;
+        }
+    } else {
+        timed_lock(&global_malloc_lock);
+        resized = pool_resize(((segment_t*)kind)->pool, header, size);
+        pthread_mutex_unlock(&global_malloc_lock);
+        if (resized) {
+            stat_resize(old_size, block_stat_size(block, 0));
+            return block;
+        }
+        if (size >= mmap_threshold && size < realloc_mmap_threshold) {
+            timed_lock(&global_malloc_lock);
+            header = pool_malloc(((segment_t*)kind)->pool, size);
+            pthread_mutex_unlock(&global_malloc_lock);
+            ret = malloc_done(header ? (void*)(header + 1) : NULL, size);
+            if (ret) {
+                block_copy(ret, block, block_size((header_t*)block - 1));
+                free(block);
+            }
+            return ret;
+        }
+    }
+
+    ret = malloc(size);
+    if (ret) {
+        usable = block_size(header);
+        block_copy(ret, block, usable < size ? usable : size);
+        free(block);
+    }
+    return ret;
+}
+
+static int tcache_accepts(thread_cache_t* cache, void* block) {
+    return node_accepts(cache->node, block);
+}
+
+// free one block; *locked tells whether the caller holds the heap lock, which
+// free_batch keeps across consecutive blocks that need it
+static void free_block(thread_cache_t* cache, void* block, int* locked) {
+    header_t* header;
+    remote_free_list_t* owner;
+    uintptr_t kind;
+    run_t* run;
+    size_t size;
+
+    kind = pointer_kind(block, "free(): invalid pointer\n");
+    if (HARDENED) {
+        hardened_check(block, kind, 0, "free(): invalid pointer\n", "free(): double free detected\n");
+        mark_freed(block);
+    }
+    if (live_samples) {
+        profile_forget(block);
+    }
+    if (kind == PAGE_SLAB) {
+        run = slab_run(block);
+        size = slab_class_size(run->size_class);
+        stat_blocks(size, 1, 1);
+        owner = __atomic_load_n(&run->owner, __ATOMIC_RELAXED);
+        if (owner && (!cache || owner != cache->remote) && remote_free(owner, block)) {
+            return;
+        }
+    } else {
+        header = (header_t*)block - 1;
+        size = block_size(header);
+        stat_blocks(block_stat_size(block, size), 1, 1);
+        if (kind == PAGE_MMAPPED) {
+            mmap_free(header);
+            return;
+        }
+    }
+    if (size <= TCACHE_MAX_SIZE && percpu_caches) {
+        if (*locked) {
+            pthread_mutex_unlock(&global_malloc_lock);
+            *locked = 0;
+        }
+        percpu_free(block, size);
+        return;
+    }
+    if (size <= TCACHE_MAX_SIZE && cache && tcache_accepts(cache, block)) {
+        // a full bin is flushed under the heap lock
+        if (*locked) {
+            pthread_mutex_unlock(&global_malloc_lock);
+            *locked = 0;
+        }
+        tcache_enter(cache);
+        tcache_put(cache, block, size);
+        tcache_leave(cache);
+        return;
+    }
+
+    if (!*locked) {
+        timed_lock(&global_malloc_lock);
+        *locked = 1;
+    }
+    small_free(block);
+}
+
+void free(void* block) {
+    int locked = 0;
+
+    if (!block) {
+        return;
+    }
+
+    free_block(get_thread_cache(), block, &locked);
+    if (locked) {
+        pthread_mutex_unlock(&global_malloc_lock);
+        if (profile_dump_pending) {
+            profile_dump_signalled();
+        }
+    }
+}
+
+// size is the one the block was last requested with, and every block is at
+// least that size rounded up to its class, so small blocks go straight into
+// the thread cache without reading their header or slab run
+void free_sized(void* block, size_t size) {
+    thread_cache_t* cache;
+
+    if (HARDENED) {
+        free(block); // the checks need the header or slab run anyway
+        return;
+    }
+    if (block && size <= TCACHE_MAX_SIZE && percpu_caches) {
+        size = size ? ALIGN(size) : ALIGNMENT;
+        stat_blocks(block_stat_size(block, size), 1, 1);
+        if (live_samples) {
+            profile_forget(block);
+        }
+        percpu_free(block, size);
+        return;
+    }
+    if (!block || size > TCACHE_MAX_SIZE || !(cache = get_thread_cache())
+        || !tcache_accepts(cache, block)) {
+        free(block);
+        return;
+    }
+    size = size ? ALIGN(size) : ALIGNMENT;
+    stat_blocks(block_stat_size(block, size), 1, 1);
+    if (live_samples) {
+        profile_forget(block);
+    }
+    tcache_enter(cache);
+    tcache_put(cache, block, size);
+    tcache_leave(cache);
+}
+
+void free_aligned_sized(void* block, size_t alignment, size_t size) {
+    // over-aligned blocks may be mmapped whatever their size
+    if (alignment > ALIGNMENT) {
+        free(block);
+        return;
+    }
+    free_sized(block, size);
+}
+
+// allocate up to num blocks of size bytes into ptrs, first from the thread
+// cache and then carving the rest under a single hold of the heap lock;
+// returns how many were allocated
+size_t malloc_batch(size_t size, size_t num, void** ptrs) {
+    header_t* header;
+    thread_cache_t* cache = NULL;
+    tcache_bin_t* bin;
+    unsigned int node;
+    void* ptr;
+    size_t i = 0;
+
+    if (size > PTRDIFF_MAX) {
+        errno = ENOMEM;
+        return 0;
+    }
+
+    size = size ? ALIGN(size) : ALIGNMENT;
+    if (size <= TCACHE_MAX_SIZE && percpu_caches) {
+        while (i < num && (ptr = percpu_pop(percpu_base(size)))) {
+            ptrs[i++] = ptr;
+        }
+    } else if (size <= TCACHE_MAX_SIZE && (cache = get_thread_cache())) {
+        tcache_enter(cache);
+        bin = &cache->bins[size / ALIGNMENT - 1];
+        if (bin->count < num) {
+            tcache_drain_remote(cache);
+        }
+        while (i < num && bin->head) {
+            ptr = bin->head;
+            bin->head = link_get(ptr);
+            bin->count--;
+            ptrs[i++] = ptr;
+        }
+        tcache_leave(cache);
+    }
+
+    if (size >= mmap_threshold) {
+        while (i < num && (header = mmap_malloc(size, ALIGNMENT))) {
+            ptrs[i++] = header + 1;
+        }
+    } else if (i < num) {
+        node = current_node();
+        timed_lock(&global_malloc_lock);
+        while (i < num && (ptr = small_malloc(node, size, cache ? cache->remote : NULL))) {
+            ptrs[i++] = ptr;
+        }
+        pthread_mutex_unlock(&global_malloc_lock);
+    }
+
+    if (i < num) {
+        errno = ENOMEM;
+    }
+    for (num = 0; num < i; num++) {
+        unmark_freed(ptrs[num]);
+        stat_blocks(block_stat_size(ptrs[num], size), 1, 0);
+    }
+    return i;
+}
+
+// free num blocks, taking the heap lock at most once per run of blocks that
+// miss the thread cache; NULL entries are skipped
+void free_batch(size_t num, void** ptrs) {
+    thread_cache_t* cache;
+    int locked = 0;
+    size_t i;
+
+    cache = get_thread_cache();
+    for (i = 0; i < num; i++) {
+        if (ptrs[i]) {
+            free_block(cache, ptrs[i], &locked);
+        }
+    }
+    if (locked) {
+        pthread_mutex_unlock(&global_malloc_lock);
+    }
+}
+
+// sizes past the caches skip zeroing what is known to be zero: a fresh
+// mapping, or pool memory never written before
+void* calloc(size_t num, size_t nsize) {
+    header_t* header;
+    unsigned int node;
+    char* zero_from;
+    size_t size;
+    void* block;
+
+    size = num * nsize;
+    if (num && nsize != size / num) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    if (size <= TCACHE_MAX_SIZE || size > PTRDIFF_MAX) {
+        block = malloc(size);
+        if (block) {
+            block_zero(block, ALIGN(size));
+        }
+        return block;
+    }
+
+    size = ALIGN(size);
+    if (size >= calloc_mmap_threshold) {
+        header = mmap_malloc(size, ALIGNMENT);
+        zero_from = (char*)(header + 1);
+    } else {
+        node = current_node();
+        timed_lock(&global_malloc_lock);
+        header = pool_malloc_fresh(node_pool(node), size, &zero_from);
+        pthread_mutex_unlock(&global_malloc_lock);
+    }
+    if (!header) {
+        return malloc_done(NULL, size);
+    }
+    block = header + 1;
+    if (zero_from > (char*)block) {
+        block_zero(block, (size_t)(zero_from - (char*)block) < size ? (size_t)(zero_from - (char*)block) : size);
+    }
+    return malloc_done(block, size);
+}
+
+void* reallocarray(void* block, size_t num, size_t nsize) {
+    size_t size = num * nsize;
+
+    if (num && nsize != size / num) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return realloc(block, size);
+}
+
+size_t malloc_usable_size(void* block) {
+    if (!block) {
+        return 0;
+    }
+    if (pointer_kind(block, "malloc_usable_size(): invalid pointer\n") == PAGE_SLAB) {
+        return slab_class_size(slab_run(block)->size_class);
+    }
+    return block_size((header_t*)block - 1);
+}
+
+// purge every free page of the node pools now, whatever its age; pad is
+// accepted for glibc compatibility and ignored
+int malloc_trim(size_t pad) {
+    size_t purged = 0;
+    unsigned int i, j, count;
+    void* head, *ptr;
+
+    (void)pad;
+    initialize_memory_pool();
+    tcache_scavenge(1);
+    // the scavenger leaves the caller's own cache alone
+    if (thread_cache.state > 0) {
+        tcache_enter(&thread_cache);
+        for (j = 0; j < TCACHE_NUM_CLASSES; j++) {
+            if (thread_cache.bins[j].head) {
+                tcache_flush(&thread_cache, &thread_cache.bins[j], (j + 1) * ALIGNMENT, thread_cache.bins[j].count);
+            }
+        }
+        tcache_leave(&thread_cache);
+    }
+    percpu_drain();
+
+    // blocks parked on the central lists cannot coalesce, give them back first
+    for (i = 0; i < num_nodes; i++) {
+        for (j = 0; j < TCACHE_NUM_CLASSES; j++) {
+            timed_lock(&central_lists[i][j].lock);
+            head = central_lists[i][j].head;
+            count = central_lists[i][j].count;
+            central_lists[i][j].head = NULL;
+            central_lists[i][j].count = 0;
+            pthread_mutex_unlock(&central_lists[i][j].lock);
+            timed_lock(&global_malloc_lock);
+            while (count--) {
+                ptr = head;
+                head = link_get(ptr);
+                small_free(ptr);
+            }
+            pthread_mutex_unlock(&global_malloc_lock);
+        }
+    }
+
+    timed_lock(&global_malloc_lock);
+    for (i = 0; i < num_nodes; i++) {
+        if (node_pools[i].current) {
+            purged += pool_purge(&node_pools[i], purge_clock(), 1);
+        }
+    }
+    pthread_mutex_unlock(&global_malloc_lock);
+    return purged > 0;
+}
+
+// the HUGE_PAGES_* backing for pool segments mapped from now on; returns 0,
+// or -1 with errno EINVAL for a mode that is none of them
+int malloc_set_huge_pages(int mode) {
+    if (mode < HUGE_PAGES_NONE || mode > HUGE_PAGES_HUGETLB) {
+        errno = EINVAL;
+        return -1;
+    }
+    timed_lock(&global_malloc_lock);
+    huge_pages = mode;
+    pthread_mutex_unlock(&global_malloc_lock);
+    return 0;
+}
+
+// how long free pages stay dirty before the next purge pass releases them
+void malloc_set_purge_decay(uint64_t ms) {
+    unsigned int i;
+
+    timed_lock(&global_malloc_lock);
+    purge_decay_ms = ms;
+    for (i = 0; i < num_nodes; i++) {
+        node_pools[i].next_purge = 0;
+    }
+    pthread_mutex_unlock(&global_malloc_lock);
+}
+
+// how long a thread cache must go unused before the scavenger empties it, 0
+// to stop scavenging
+void malloc_set_scavenge_interval(uint64_t ms) {
+    pthread_mutex_lock(&scavenge_lock);
+    scavenge_interval_ms = ms;
+    __atomic_store_n(&next_scavenge, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&scavenge_lock);
+}
+
+// hold the heap lock across fork() so the child never inherits it mid-update;
+// the child has only the forking thread, so it takes a fresh lock instead
+static void fork_prepare() {
+    unsigned int i, j;
+
+    pthread_mutex_lock(&scavenge_lock);
+    for (i = 0; i < num_nodes; i++) {
+        for (j = 0; j < TCACHE_NUM_CLASSES; j++) {
+            pthread_mutex_lock(&central_lists[i][j].lock);
+        }
+    }
+    pthread_mutex_lock(&global_malloc_lock);
+    pthread_mutex_lock(&profile_lock);
+}
+
+static void fork_parent() {
+    unsigned int i, j;
+
+    pthread_mutex_unlock(&profile_lock);
+    pthread_mutex_unlock(&global_malloc_lock);
+    for (i = 0; i < num_nodes; i++) {
+        for (j = 0; j < TCACHE_NUM_CLASSES; j++) {
+            pthread_mutex_unlock(&central_lists[i][j].lock);
+        }
+    }
+    pthread_mutex_unlock(&scavenge_lock);
+}
+
+static void fork_child() {
+    thread_cache_t* cache, *next;
+    unsigned int i, j;
+
+    pthread_mutex_init(&global_malloc_lock, NULL);
+    pthread_mutex_init(&profile_lock, NULL);
+    pthread_mutex_init(&scavenge_lock, NULL);
+    for (i = 0; i < num_nodes; i++) {
+        for (j = 0; j < TCACHE_NUM_CLASSES; j++) {
+            pthread_mutex_init(&central_lists[i][j].lock, NULL);
+        }
+    }
+
+    // the other threads are gone, and glibc hands their TLS to the next ones
+    // it creates, zeroed: take back what their caches held while it is still
+    // intact, dropping the bins of a thread that was using them at the fork
+    for (cache = all_thread_caches; cache; cache = next) {
+        next = cache->next;
+        if (cache != &thread_cache) {
+            tcache_release(cache, !(cache->seq & 1));
+        }
+    }
+    all_thread_caches = thread_cache.state > 0 ? &thread_cache : NULL;
+    thread_cache.next = thread_cache.prev = NULL;
+}
+
+// at load time, so that the hot paths need no once-barrier: malloc only ever
+// checks whether its thread cache exists. Fork handlers are registered here
+// rather than from inside malloc, where pthread_atfork could allocate.
+__attribute__((constructor))
+static void initialize_at_load() {
+    initialize_memory_pool();
+    pthread_atfork(fork_prepare, fork_parent, fork_child);
+}
+
+// carve a block whose payload is aligned to alignment out of a larger one and
+// give the unused space in front of and behind it back to the free lists
+static header_t* pool_memalign(memory_pool_t* pool, size_t alignment, size_t size) {
+    header_t* header, *aligned, *tail;
+    uintptr_t payload;
+    size_t lead, excess;
+
+    size = size < MIN_BLOCK_SIZE ? MIN_BLOCK_SIZE : BLOCK_ALIGN(size);
+    header = pool_malloc(pool, size + alignment + sizeof(header_t) + MIN_BLOCK_SIZE);
+    if (!header) {
+        return NULL;
+    }
+
+    payload = (uintptr_t)(header + 1);
+    if (payload & (alignment - 1)) {
+        // the leading gap must be large enough to become a free block itself
+        payload = (payload + sizeof(header_t) + MIN_BLOCK_SIZE + alignment - 1) & ~(uintptr_t)(alignment - 1);
+        aligned = (header_t*)payload - 1;
+        lead = (char*)aligned - (char*)(header + 1);
+        header_set(aligned, block_size(header) - lead - sizeof(header_t));
+        set_block_size(header, lead);
+        pool_free(pool, header);
+        header = aligned;
+    }
+
+    excess = block_size(header) - size;
+    if (excess >= sizeof(header_t) + MIN_BLOCK_SIZE) {
+        tail = (header_t*)((char*)(header + 1) + size);
+        header_set(tail, excess - sizeof(header_t));
+        set_block_size(header, size);
+        pool_free(pool, tail);
+    }
+    return header;
+}
+
+static void* aligned_malloc(size_t alignment, size_t size) {
+    header_t* header;
+    unsigned int node;
+
+    if (alignment <= ALIGNMENT) {
+        return malloc(size);
+    }
+    if (size > PTRDIFF_MAX || alignment > PTRDIFF_MAX / 2) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    // size 0 gets a unique pointer, as from malloc(0)
+    size = size ? ALIGN(size) : ALIGNMENT;
+    if (size >= mmap_threshold) {
+        header = mmap_malloc(size, alignment);
+    } else {
+        node = current_node();
+        timed_lock(&global_malloc_lock);
+        header = pool_memalign(node_pool(node), alignment, size);
+        pthread_mutex_unlock(&global_malloc_lock);
+    }
+    return malloc_done(header ? (void*)(header + 1) : NULL, size);
+}
+
+int posix_memalign(void** memptr, size_t alignment, size_t size) {
+    void* block;
+    int saved_errno = errno;
+
+    if (alignment % sizeof(void*) || (alignment & (alignment - 1)) || !alignment) {
+        return EINVAL;
+    }
+    block = aligned_malloc(alignment, size);
+    errno = saved_errno;
+    if (!block) {
+        return ENOMEM;
+    }
+    *memptr = block;
+    return 0;
+}
+
+void* aligned_alloc(size_t alignment, size_t size) {
+    if ((alignment & (alignment - 1)) || !alignment) {
+        errno = EINVAL;
+        return NULL;
+    }
+    return aligned_malloc(alignment, size);
+}
+
+// like glibc, memalign() rounds an alignment that is not a power of two up to one
+void* memalign(size_t alignment, size_t size) {
+    size_t power = ALIGNMENT;
+
+    while (power < alignment && power <= PTRDIFF_MAX / 2) {
+        power <<= 1;
+    }
+    return aligned_malloc(power, size);
+}
+
+void* valloc(size_t size) {
+    return aligned_malloc(sysconf(_SC_PAGESIZE), size);
+}
+
+void* pvalloc(size_t size) {
+    size_t page = sysconf(_SC_PAGESIZE);
+
+    if (size > PTRDIFF_MAX) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return aligned_malloc(page, size ? (size + page - 1) & ~(page - 1) : page);
+}
+
+// arenas: independent heaps, each with its own memory_pool_t and lock. Memory
+// from an arena goes back through arena_free() or all at once with arena_reset().
+typedef struct Arena {
+    memory_pool_t pool;
+    pthread_mutex_t lock;
+} arena_t;
+
+arena_t* arena_create() {
+    arena_t* arena = mmap(NULL, PAGE_ALIGN(sizeof(arena_t)), PROT_READ | PROT_WRITE,
+                          MAP_ANON | MAP_PRIVATE, -1, 0);
+    if (arena == MAP_FAILED) {
+        return NULL;
+    }
+    pthread_mutex_init(&arena->lock, NULL);
+    arena->pool.node = -1; // first touch decides, like any private mapping
+    arena->pool.current = segment_create(&arena->pool, PAGE_ALIGN(segment_size));
+    if (!arena->pool.current) {
+        munmap(arena, PAGE_ALIGN(sizeof(arena_t)));
+        return NULL;
+    }
+    return arena;
+}
+
+void* arena_malloc(arena_t* arena, size_t size) {
+    header_t* header;
+
+    if (size == 0 || size > PTRDIFF_MAX) {
+        return NULL;
+    }
+    size = ALIGN(size);
+    pthread_mutex_lock(&arena->lock);
+    header = pool_malloc(&arena->pool, size);
+    pthread_mutex_unlock(&arena->lock);
+    return header ? (void*)(header + 1) : NULL;
+}
+
+void arena_free(arena_t* arena, void* block) {
+    if (!block) {
+        return;
+    }
+    pthread_mutex_lock(&arena->lock);
+    pool_free(&arena->pool, (header_t*)block - 1);
+    pthread_mutex_unlock(&arena->lock);
+}
+
+// drop every allocation at once: keep the newest (largest) segment, empty it,
+// and unmap the rest. The cost does not depend on how much was allocated.
+void arena_reset(arena_t* arena) {
+    memory_pool_t* pool = &arena->pool;
+    segment_t* keep;
+    unsigned int i;
+
+    pthread_mutex_lock(&arena->lock);
+    keep = pool->current;
+    for (i = 0; i < pool->num_segments; i++) {
+        if (pool->segments[i] != keep) {
+            pagemap_set(pool->segments[i], pool->segments[i]->size, 0);
+            munmap(pool->segments[i], pool->segments[i]->size);
+            stat_add(thread_stats(), &thread_stats()->segments_unmapped, 1);
+        }
+    }
+    memset(pool->bins, 0, sizeof(pool->bins));
+    memset(pool->bin_bitmap, 0, sizeof(pool->bin_bitmap));
+    pool->bin_summary = 0;
+    pool->segments[0] = keep;
+    pool->num_segments = 1;
+    pool->mapped_memory = keep->size;
+    pool->allocated_memory = 0;
+    pool->free_memory = 0;
+    pool->dirty_memory = 0;
+    if (keep->top > pool->dirty_end) {
+        pool->dirty_end = keep->top;
+    }
+    pool->dirty_end_since = purge_clock();
+    keep->top = (char*)keep + SEGMENT_HEADER_SIZE;
+    pthread_mutex_unlock(&arena->lock);
+}
+
+void arena_destroy(arena_t* arena) {
+    unsigned int i;
+
+    for (i = 0; i < arena->pool.num_segments; i++) {
+        pagemap_set(arena->pool.segments[i], arena->pool.segments[i]->size, 0);
+        munmap(arena->pool.segments[i], arena->pool.segments[i]->size);
+        stat_add(thread_stats(), &thread_stats()->segments_unmapped, 1);
+    }
+    pthread_mutex_destroy(&arena->lock);
+    munmap(arena, PAGE_ALIGN(sizeof(arena_t)));
+}
+
+// debugging
+// totals over all node pools
+size_t get_allocated_memory() {
+    size_t total = 0;
+    unsigned int i;
+
+    for (i = 0; i < num_nodes; i++) {
+        total += node_pools[i].allocated_memory;
+    }
+    return total;
+}
+
+size_t get_free_memory() {
+    size_t total = 0;
+    unsigned int i;
+
+    for (i = 0; i < num_nodes; i++) {
+        total += node_pools[i].free_memory;
+    }
+    return total;
+}
+
+size_t get_mapped_memory() {
+    size_t total = 0;
+    unsigned int i;
+
+    for (i = 0; i < num_nodes; i++) {
+        total += node_pools[i].mapped_memory;
+    }
+    return total;
+}
+
+size_t get_mmapped_memory() {
+    return __atomic_load_n(&mmapped_memory, __ATOMIC_RELAXED);
+}
+
+size_t get_slab_memory() {
+    size_t total = 0;
+    unsigned int i;
+
+    for (i = 0; i < num_nodes; i++) {
+        total += node_slabs[i].committed_memory;
+    }
+    return total;
+}
+
+size_t get_dirty_memory() {
+    size_t total = 0;
+    unsigned int i;
+    char* start;
+
+    for (i = 0; i < num_nodes; i++) {
+        total += node_pools[i].dirty_memory;
+        if (node_pools[i].dirty_end) {
+            total += purge_range_top(&node_pools[i], &start);
+        }
+    }
+    return total;
+}
+
+size_t get_purged_memory() {
+    size_t total = 0;
+    unsigned int i;
+
+    for (i = 0; i < num_nodes; i++) {
+        total += node_pools[i].purged_memory;
+    }
+    return total;
+}
+
+size_t get_scavenged_blocks() {
+    return scavenged_blocks;
+}
+
+// named statistics for mallctl() and malloc_stats_write(): pool gauges read
+// under the heap lock, then the counters summed over every thread
+typedef struct {
+    const char* name;
+    size_t (*get)();
+    size_t offset; // into thread_stats_t when get is NULL
+} stat_name_t;
+
+static const stat_name_t stat_names[] = {
+    {"stats.allocated", get_allocated_memory, 0},
+    {"stats.free", get_free_memory, 0},
+    {"stats.mapped", get_mapped_memory, 0},
+    {"stats.mmapped", get_mmapped_memory, 0},
+    {"stats.slab", get_slab_memory, 0},
+    {"stats.dirty", get_dirty_memory, 0},
+    {"stats.purged", get_purged_memory, 0},
+    {"stats.scavenged", get_scavenged_blocks, 0},
+    {"stats.slow_allocs", NULL, offsetof(thread_stats_t, slow_allocs)},
+    {"stats.slow_frees", NULL, offsetof(thread_stats_t, slow_frees)},
+    {"stats.lock_waits", NULL, offsetof(thread_stats_t, lock_waits)},
+    {"stats.lock_wait_ns", NULL, offsetof(thread_stats_t, lock_wait_ns)},
+    {"stats.segments_mapped", NULL, offsetof(thread_stats_t, segments_mapped)},
+    {"stats.segments_unmapped", NULL, offsetof(thread_stats_t, segments_unmapped)},
+};
+
+#define NUM_STAT_NAMES (sizeof(stat_names) / sizeof(stat_names[0]))
+
+static const stat_name_t class_stat_names[] = {
+    {"allocs", NULL, offsetof(class_stats_t, allocs)},
+    {"frees", NULL, offsetof(class_stats_t, frees)},
+    {"bytes_allocated", NULL, offsetof(class_stats_t, bytes_allocated)},
+    {"bytes_freed", NULL, offsetof(class_stats_t, bytes_freed)},
+};
+
+#define NUM_CLASS_STAT_NAMES (sizeof(class_stat_names) / sizeof(class_stat_names[0]))
+
+typedef struct {
+    uint64_t gauges[NUM_STAT_NAMES];
+    thread_stats_t counters;
+} stats_snapshot_t;
+
+static uint64_t stat_field(const void* base, size_t offset) {
+    return *(const uint64_t*)((const char*)base + offset);
+}
+
+static void stats_snapshot(stats_snapshot_t* snapshot) {
+    uint64_t* total = (uint64_t*)&snapshot->counters;
+    uint64_t* counters;
+    thread_stats_t* stats;
+    size_t i;
+
+    initialize_memory_pool();
+    memset(snapshot, 0, sizeof(*snapshot));
+    pthread_mutex_lock(&global_malloc_lock);
+    for (i = 0; i < NUM_STAT_NAMES; i++) {
+        if (stat_names[i].get) {
+            snapshot->gauges[i] = stat_names[i].get();
+        }
+    }
+    pthread_mutex_unlock(&global_malloc_lock);
+
+    stats = &shared_stats;
+    while (stats) {
+        counters = (uint64_t*)stats;
+        for (i = 0; i < offsetof(thread_stats_t, next) / sizeof(uint64_t); i++) {
+            total[i] += __atomic_load_n(&counters[i], __ATOMIC_RELAXED);
+        }
+        stats = stats == &shared_stats ? __atomic_load_n(&all_thread_stats, __ATOMIC_ACQUIRE) : stats->next;
+    }
+    for (i = 0; i < TCACHE_NUM_CLASSES; i++) {
+        snapshot->counters.classes[i].bytes_allocated = snapshot->counters.classes[i].allocs * (i + 1) * ALIGNMENT;
+        snapshot->counters.classes[i].bytes_freed = snapshot->counters.classes[i].frees * (i + 1) * ALIGNMENT;
+    }
+}
+
+static uint64_t snapshot_value(stats_snapshot_t* snapshot, size_t i) {
+    return stat_names[i].get ? snapshot->gauges[i] : stat_field(&snapshot->counters, stat_names[i].offset);
+}
+
+// the upper bound of a class, 0 for the one holding every larger size
+static uint64_t class_size(size_t class) {
+    return class < TCACHE_NUM_CLASSES ? (class + 1) * ALIGNMENT : 0;
+}
+
+// "stats.<name>", "stats.classes" or "stats.classes.<i>.<size|allocs|...>"
+static int stats_lookup(const char* name, uint64_t* value) {
+    stats_snapshot_t snapshot;
+    unsigned long class;
+    char* end;
+    size_t i;
+
+    if (!strcmp(name, "stats.classes")) {
+        *value = STATS_NUM_CLASSES;
+        return 0;
+    }
+    if (!strncmp(name, "stats.classes.", 14)) {
+        class = strtoul(name + 14, &end, 10);
+        if (end == name + 14 || *end != '.' || class >= STATS_NUM_CLASSES) {
+            return ENOENT;
+        }
+        if (!strcmp(end + 1, "size")) {
+            *value = class_size(class);
+            return 0;
+        }
+        for (i = 0; i < NUM_CLASS_STAT_NAMES; i++) {
+            if (!strcmp(end + 1, class_stat_names[i].name)) {
+                stats_snapshot(&snapshot);
+                *value = stat_field(&snapshot.counters.classes[class], class_stat_names[i].offset);
+                return 0;
+            }
+        }
+        return ENOENT;
+    }
+    for (i = 0; i < NUM_STAT_NAMES; i++) {
+        if (!strcmp(name, stat_names[i].name)) {
+            stats_snapshot(&snapshot);
+            *value = snapshot_value(&snapshot, i);
+            return 0;
+        }
+    }
+    return ENOENT;
+}
+
+// a new value for an option from mallctl(); 0, EINVAL when it is out of range
+// or EPERM for one only read at startup
+static int option_write(const option_t* option, uint64_t value) {
+    if (value < option->min || value > option->max) {
+        return EINVAL;
+    }
+    if (option->startup_only) {
+        return EPERM;
+    }
+    if (option->set) {
+        option->set(value);
+    } else {
+        timed_lock(&global_malloc_lock);
+        *option->value = value;
+        pthread_mutex_unlock(&global_malloc_lock);
+    }
+    return 0;
+}
+
+// jemalloc-style control: every name reads as a uint64_t, and the "opt."
+// names of options[] also take a new one in newp, after the old one has been
+// read. Returns 0, ENOENT for an unknown name, EINVAL when *oldlenp or newlen
+// is not the value's size or the new value is out of range, and EPERM when
+// the name cannot be written. Never allocates.
+int mallctl(const char* name, void* oldp, size_t* oldlenp, void* newp, size_t newlen) {
+    const option_t* option = NULL;
+    uint64_t value;
+    int error;
+
+    if (!strncmp(name, "opt.", 4)) {
+        if (!(option = option_find(name + 4, strlen(name + 4)))) {
+            return ENOENT;
+        }
+        value = *option->value;
+    } else if (newp || newlen) {
+        return EPERM;
+    } else if ((error = stats_lookup(name, &value))) {
+        return error;
+    }
+    if ((newp || newlen) && (!newp || newlen != sizeof(value))) {
+        return EINVAL;
+    }
+    if (oldp && oldlenp) {
+        if (*oldlenp != sizeof(value)) {
+            return EINVAL;
+        }
+        memcpy(oldp, &value, sizeof(value));
+    }
+    if (oldlenp) {
+        *oldlenp = sizeof(value);
+    }
+    if (newp) {
+        memcpy(&value, newp, sizeof(value));
+        return option_write(option, value);
+    }
+    return 0;
+}
+
+// formatted output through a stack buffer and write(), so that dumping never
+// allocates or takes stdio's locks
+typedef struct {
+    int fd;
+    size_t len;
+    char buf[4096];
+} stats_writer_t;
+
+static void stats_flush(stats_writer_t* out) {
+    size_t done = 0;
+    ssize_t n;
+
+    while (done < out->len && (n = write(out->fd, out->buf + done, out->len - done)) > 0) {
+        done += n;
+    }
+    out->len = 0;
+}
+
+static void stats_printf(stats_writer_t* out, const char* format, ...) {
+    va_list args;
+    int n;
+
+    if (out->len > sizeof(out->buf) - 256) {
+        stats_flush(out);
+    }
+    va_start(args, format);
+    n = vsnprintf(out->buf + out->len, sizeof(out->buf) - out->len, format, args);
+    va_end(args);
+    if (n > 0) {
+        out->len += (size_t)n < sizeof(out->buf) - out->len ? (size_t)n : sizeof(out->buf) - out->len - 1;
+    }
+}
+
+// dump every statistic to fd, as "name value" lines or as one JSON object;
+// classes nobody used are left out of the text form
+void malloc_stats_write(int fd, int json) {
+    stats_snapshot_t snapshot;
+    stats_writer_t out;
+    class_stats_t* class;
+    size_t i, j;
+
+    out.fd = fd;
+    out.len = 0;
+    stats_snapshot(&snapshot);
+    if (json) {
+        stats_printf(&out, "{\"stats\": {");
+    }
+    for (i = 0; i < NUM_STAT_NAMES; i++) {
+        if (json) {
+            stats_printf(&out, "\"%s\": %llu, ", stat_names[i].name + 6,
+                         (unsigned long long)snapshot_value(&snapshot, i));
+        } else {
+            stats_printf(&out, "%s %llu\n", stat_names[i].name, (unsigned long long)snapshot_value(&snapshot, i));
+        }
+    }
+    if (json) {
+        stats_printf(&out, "\"classes\": [");
+    }
+    for (i = 0; i < STATS_NUM_CLASSES; i++) {
+        class = &snapshot.counters.classes[i];
+        if (json) {
+            stats_printf(&out, "%s{\"size\": %llu", i ? ", " : "", (unsigned long long)class_size(i));
+            for (j = 0; j < NUM_CLASS_STAT_NAMES; j++) {
+                stats_printf(&out, ", \"%s\": %llu", class_stat_names[j].name,
+                             (unsigned long long)stat_field(class, class_stat_names[j].offset));
+            }
+            stats_printf(&out, "}");
+        } else if (class->allocs || class->frees) {
+            stats_printf(&out, "stats.classes.%zu.size %llu\n", i, (unsigned long long)class_size(i));
+            for (j = 0; j < NUM_CLASS_STAT_NAMES; j++) {
+                stats_printf(&out, "stats.classes.%zu.%s %llu\n", i, class_stat_names[j].name,
+                             (unsigned long long)stat_field(class, class_stat_names[j].offset));
+            }
+        }
+    }
+    if (json) {
+        stats_printf(&out, "]}}\n");
+    }
+    stats_flush(&out);
+}
+
+// glibc's malloc_stats(), in the text form on stderr
+void malloc_stats() {
+    malloc_stats_write(STDERR_FILENO, 0);
+}
+
+// glibc's mallinfo2() from a snapshot: arena is the pool and slab memory,
+// uordblks what the class counters say is live outside mapped blocks,
+// fordblks the rest of the arena, which counts the caches, and keepcost the
+// dirty pages a trim would purge. Blocks are not counted, ordblks and hblks
+// read 0.
+struct mallinfo2 mallinfo2() {
+    stats_snapshot_t snapshot;
+    struct mallinfo2 info;
+    uint64_t live = 0;
+    size_t i;
+
+    stats_snapshot(&snapshot);
+    for (i = 0; i < STATS_NUM_CLASSES; i++) {
+        live += snapshot.counters.classes[i].bytes_allocated - snapshot.counters.classes[i].bytes_freed;
+    }
+    memset(&info, 0, sizeof(info));
+    timed_lock(&global_malloc_lock);
+    info.arena = get_mapped_memory() + get_slab_memory();
+    info.hblkhd = get_mmapped_memory();
+    info.keepcost = get_dirty_memory();
+    pthread_mutex_unlock(&global_malloc_lock);
+    info.uordblks = live > info.hblkhd ? live - info.hblkhd : 0;
+    if (info.uordblks > info.arena) {
+        info.uordblks = info.arena;
+    }
+    info.fordblks = info.arena - info.uordblks;
+    return info;
+}
+
+// the same in ints, which glibc lets wrap past 2 GiB
+struct mallinfo mallinfo() {
+    struct mallinfo2 info2 = mallinfo2();
+    struct mallinfo info;
+
+    memset(&info, 0, sizeof(info));
+    info.arena = (int)info2.arena;
+    info.hblkhd = (int)info2.hblkhd;
+    info.uordblks = (int)info2.uordblks;
+    info.fordblks = (int)info2.fordblks;
+    info.keepcost = (int)info2.keepcost;
+    return info;
+}
+
+// glibc's mallopt(): M_MMAP_THRESHOLD sets the mmap_threshold option;
+// returns 1, or 0 for a value out of its range and every other parameter
+int mallopt(int param, int value) {
+    if (param != M_MMAP_THRESHOLD || value < 0) {
+        return 0;
+    }
+    return !option_write(option_find("mmap_threshold", 14), value);
+}
+
+// glibc's malloc_info(), the same totals as mallinfo2() in its XML form
+int malloc_info(int options, FILE* stream) {
+    struct mallinfo2 info;
+
+    if (options) {
+        errno = EINVAL;
+        return -1;
+    }
+    info = mallinfo2();
+    fprintf(stream, "<malloc version=\"1\">\n");
+    fprintf(stream, "<total type=\"rest\" count=\"0\" size=\"%zu\"/>\n", info.fordblks);
+    fprintf(stream, "<total type=\"mmap\" count=\"0\" size=\"%zu\"/>\n", info.hblkhd);
+    fprintf(stream, "<system type=\"current\" size=\"%zu\"/>\n", info.arena);
+    fprintf(stream, "<aspace type=\"total\" size=\"%zu\"/>\n", info.arena);
+    fprintf(stream, "</malloc>\n");
+    return 0;
+}
+
+// the live samples in the legacy text heap profile format pprof reads, with
+// the mappings it needs to symbolize them; caller holds profile_lock
+static int profile_write_locked(int fd) {
+    stats_writer_t out;
+    sample_t* sample;
+    size_t live_bytes = 0;
+    ssize_t n;
+    int i, j, maps;
+
+    out.fd = fd;
+    out.len = 0;
+    for (i = 0; i < (1 << PROFILE_BUCKET_BITS); i++) {
+        for (sample = sample_buckets[i]; sample; sample = sample->next) {
+            live_bytes += sample->size;
+        }
+    }
+    stats_printf(&out, "heap profile: %zu: %zu [%llu: %llu] @ heap_v2/%zu\n", live_samples, live_bytes,
+                 (unsigned long long)sampled_allocs, (unsigned long long)sampled_bytes, profile_rate);
+    for (i = 0; i < (1 << PROFILE_BUCKET_BITS); i++) {
+        for (sample = sample_buckets[i]; sample; sample = sample->next) {
+            stats_printf(&out, "1: %zu [1: %zu] @", sample->size, sample->size);
+            for (j = 0; j < sample->depth; j++) {
+                stats_printf(&out, " %p", sample->stack[j]);
+            }
+            stats_printf(&out, "\n");
+        }
+    }
+    stats_printf(&out, "\nMAPPED_LIBRARIES:\n");
+    stats_flush(&out);
+
+    if ((maps = open("/proc/self/maps", O_RDONLY | O_CLOEXEC)) < 0) {
+        return -1;
+    }
+    while ((n = read(maps, out.buf, sizeof(out.buf))) > 0) {
+        out.len = n;
+        stats_flush(&out);
+    }
+    close(maps);
+    return 0;
+}
+
+// profile of the blocks sampled and not yet freed, to fd or the file at path;
+// returns 0 or -1
+int malloc_profile_write(int fd) {
+    int ret;
+
+    pthread_mutex_lock(&profile_lock);
+    ret = profile_write_locked(fd);
+    pthread_mutex_unlock(&profile_lock);
+    return ret;
+}
+
+int malloc_profile_dump(const char* path) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    int ret;
+
+    if (fd < 0) {
+        return -1;
+    }
+    ret = malloc_profile_write(fd);
+    close(fd);
+    return ret;
+}
+
+// sample one allocation per rate bytes on average, 0 to stop sampling; live
+// samples stay until their blocks are freed
+void malloc_set_profile_rate(size_t rate) {
+    void* frame;
+
+    // the unwinder loads libgcc on first use, spare the first sample that
+    backtrace(&frame, 1);
+    __atomic_store_n(&profile_rate, rate, __ATOMIC_RELAXED);
+}
+
+// nothing the dump needs is async-signal-safe, so the handler only raises
+// the flag, and the next malloc, or free that takes the heap lock, writes the
+// dump
+static void profile_signal_handler(int signo) {
+    (void)signo;
+    profile_dump_pending = 1;
+}
+
+// dump the profile to path at the first malloc after signo is delivered;
+// returns 0 or -1
+int malloc_profile_signal(int signo, const char* path) {
+    struct sigaction action;
+
+    if (strlen(path) >= sizeof(profile_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    pthread_mutex_lock(&profile_lock);
+    strcpy(profile_path, path);
+    pthread_mutex_unlock(&profile_lock);
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = profile_signal_handler;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    return sigaction(signo, &action, NULL);
+}
+
+// heap map: every segment and block of the node pools and every slab run,
+// walked under the heap lock. Blocks still sitting in thread caches or central
+// lists count as in use.
+#define HEAP_HISTOGRAM_BUCKETS 64 // bucket i holds sizes in [2^i, 2^(i+1))
+
+typedef struct {
+    size_t count[HEAP_HISTOGRAM_BUCKETS];
+    size_t bytes[HEAP_HISTOGRAM_BUCKETS];
+} heap_histogram_t;
+
+static void histogram_add(heap_histogram_t* histogram, size_t size) {
+    unsigned int bucket = size ? 63 - __builtin_clzll(size) : 0;
+
+    histogram->count[bucket]++;
+    histogram->bytes[bucket] += size;
+}
+
+static void histogram_write(stats_writer_t* out, const char* name, heap_histogram_t* histogram) {
+    int i, first = 1;
+
+    stats_printf(out, "\"%s\": [", name);
+    for (i = 0; i < HEAP_HISTOGRAM_BUCKETS; i++) {
+        if (histogram->count[i]) {
+            stats_printf(out, "%s{\"min\": %zu, \"count\": %zu, \"bytes\": %zu}", first ? "" : ", ",
+                         (size_t)1 << i, histogram->count[i], histogram->bytes[i]);
+            first = 0;
+        }
+    }
+    stats_printf(out, "], ");
+}
+
+static double ratio(size_t part, size_t whole) {
+    return whole ? (double)part / whole : 0;
+}
+
+// the heap map as one JSON object, to fd or the file at path; with blocks set,
+// every segment also lists its blocks as [offset, size, free]. Returns 0, or
+// -1 when path cannot be opened.
+int malloc_heap_write(int fd, int blocks) {
+    heap_histogram_t free_sizes, used_sizes;
+    size_t runs[SLAB_NUM_CLASSES], objects[SLAB_NUM_CLASSES], used[SLAB_NUM_CLASSES];
+    size_t pool_used = 0, pool_free = 0, tail = 0, largest = 0, headers = 0;
+    size_t slab_used = 0, slab_overhead = 0, slab_stranded = 0, empty_runs = 0;
+    size_t segment_used, segment_free, segment_largest, free_blocks, used_blocks, size;
+    stats_writer_t out;
+    memory_pool_t* pool;
+    segment_t* segment;
+    slab_heap_t* slabs;
+    header_t* block;
+    run_t* run;
+    unsigned int i, j, capacity;
+    char* start;
+
+    initialize_memory_pool();
+    memset(&free_sizes, 0, sizeof(free_sizes));
+    memset(&used_sizes, 0, sizeof(used_sizes));
+    memset(runs, 0, sizeof(runs));
+    memset(objects, 0, sizeof(objects));
+    memset(used, 0, sizeof(used));
+    out.fd = fd;
+    out.len = 0;
+
+    pthread_mutex_lock(&global_malloc_lock);
+    stats_printf(&out, "{\"segments\": [");
+    for (i = 0; i < num_nodes; i++) {
+        pool = &node_pools[i];
+        for (j = 0; j < pool->num_segments; j++) {
+            segment = pool->segments[j];
+            start = (char*)segment + SEGMENT_HEADER_SIZE;
+            segment_used = segment_free = segment_largest = free_blocks = used_blocks = 0;
+            stats_printf(&out, "%s{\"node\": %u, \"start\": \"%p\", \"size\": %zu, \"huge\": %d",
+                         i || j ? ", " : "", i, (void*)segment, segment->size, segment->huge);
+            if (blocks) {
+                stats_printf(&out, ", \"blocks\": [");
+            }
+            for (block = (header_t*)start; (char*)block < segment->top && block_size(block);
+                 block = (header_t*)((char*)(block + 1) + block_size(block))) {
+                size = block_size(block);
+                if (block->size & BLOCK_FREE) {
+                    segment_free += size;
+                    free_blocks++;
+                    segment_largest = size > segment_largest ? size : segment_largest;
+                    histogram_add(&free_sizes, size);
+                } else {
+                    segment_used += size;
+                    used_blocks++;
+                    histogram_add(&used_sizes, size);
+                }
+                if (blocks) {
+                    stats_printf(&out, "%s[%zu, %zu, %d]", (char*)block == start ? "" : ", ",
+                                 (size_t)((char*)block - (char*)segment), size, !!(block->size & BLOCK_FREE));
+                }
+            }
+            if (blocks) {
+                stats_printf(&out, "]");
+            }
+            stats_printf(&out, ", \"used\": %zu, \"used_blocks\": %zu, \"free\": %zu, \"free_blocks\": %zu, "
+                         "\"largest_free\": %zu, \"tail\": %zu}", segment_used, used_blocks, segment_free,
+                         free_blocks, segment_largest,
+                         segment == pool->current ? (size_t)(segment->limit - segment->top) : 0);
+            pool_used += segment_used;
+            pool_free += segment_free;
+            headers += used_blocks * sizeof(header_t);
+            largest = segment_largest > largest ? segment_largest : largest;
+            if (segment == pool->current) {
+                tail += segment->limit - segment->top;
+            }
+        }
+    }
+    stats_printf(&out, "], ");
+    histogram_write(&out, "free_histogram", &free_sizes);
+    histogram_write(&out, "used_histogram", &used_sizes);
+
+    for (i = 0; i < num_nodes; i++) {
+        slabs = &node_slabs[i];
+        for (start = slabs->start; start && start < slabs->top; start += SLAB_RUN_SIZE) {
+            run = (run_t*)start;
+            capacity = slab_capacity(run->size_class);
+            if (run->free_count == capacity) {
+                empty_runs++;
+                continue;
+            }
+            runs[run->size_class]++;
+            objects[run->size_class] += capacity;
+            used[run->size_class] += capacity - run->free_count;
+            slab_overhead += SLAB_RUN_SIZE - capacity * slab_class_size(run->size_class);
+            slab_stranded += run->free_count * slab_class_size(run->size_class);
+        }
+    }
+    stats_printf(&out, "\"slab_classes\": [");
+    for (i = 0; i < SLAB_NUM_CLASSES; i++) {
+        slab_used += used[i] * slab_class_size(i);
+        stats_printf(&out, "%s{\"size\": %zu, \"runs\": %zu, \"objects\": %zu, \"used\": %zu, "
+                     "\"utilisation\": %.4f}", i ? ", " : "", slab_class_size(i), runs[i], objects[i], used[i],
+                     ratio(used[i], objects[i]));
+    }
+    pthread_mutex_unlock(&global_malloc_lock);
+
+    // external: free pool memory that no single request can use at once;
+    // internal: headers of blocks in use and slab run headers and slack, over
+    // the memory held by blocks and runs in use
+    stats_printf(&out, "], \"summary\": {\"pool_used\": %zu, \"pool_free\": %zu, \"tail\": %zu, "
+                 "\"largest_free\": %zu, \"headers\": %zu, \"slab_used\": %zu, \"slab_stranded\": %zu, "
+                 "\"slab_overhead\": %zu, \"slab_empty_runs\": %zu, \"external_fragmentation\": %.4f, "
+                 "\"internal_fragmentation\": %.4f}}\n", pool_used, pool_free, tail, largest, headers,
+                 slab_used, slab_stranded, slab_overhead, empty_runs,
+                 pool_free ? 1 - ratio(largest, pool_free) : 0,
+                 ratio(headers + slab_overhead, pool_used + headers + slab_used + slab_stranded + slab_overhead));
+    stats_flush(&out);
+    return 0;
+}
+
+int malloc_heap_dump(const char* path, int blocks) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    int ret;
+
+    if (fd < 0) {
+        return -1;
+    }
+    ret = malloc_heap_write(fd, blocks);
+    close(fd);
+    return ret;
+}
+
+void print_memory_usage() {
+    printf("Allocated memory: %zu bytes\n", get_allocated_memory());
+    printf("Free memory: %zu bytes\n", get_free_memory());
+    printf("Mmapped memory: %zu bytes\n", get_mmapped_memory());
+    printf("Slab memory: %zu bytes\n", get_slab_memory());
+    printf("Dirty memory: %zu bytes\n", get_dirty_memory());
+    printf("Purged memory: %zu bytes\n", get_purged_memory());
+}
+
+void print_free_list() {
+    memory_pool_t* pool;
+    header_t* curr;
+    unsigned int i;
+    int bin;
+
+    printf("Free list:\n");
+    for (i = 0; i < num_nodes; i++) {
+        pool = &node_pools[i];
+        for (bin = find_nonempty_bin(pool, 0); bin >= 0; bin = find_nonempty_bin(pool, bin + 1)) {
+            for (curr = pool->bins[bin]; curr; curr = free_links(curr)->next) {
+                printf("Node %u bin %d: block at %p, size: %zu\n", i, bin, (void*)curr, block_size(curr));
+            }
+        }
+    }
+}
+
+void print_pool_status() {
+    memory_pool_t* pool;
+    segment_t* segment;
+    unsigned int i, j;
+
+    for (i = 0; i < num_nodes; i++) {
+        pool = &node_pools[i];
+        for (j = 0; j < pool->num_segments; j++) {
+            segment = pool->segments[j];
+            printf("Node %u segment %u: %p - %p, %zu bytes, %zu in use\n", i, j, (void*)segment,
+                   (void*)((char*)segment + segment->size), segment->size,
+                   (size_t)(segment->top - (char*)segment));
+        }
+    }
+    printf("Total pool size: %zu bytes\n", get_mapped_memory());
 }
 
+#ifndef MALLOC_LIBRARY
 // Test program 1
 int main() {
     printf("Initializing memory pool...\n");
@@ -280,3 +4133,4 @@ int main() {
 
     return 0;
 }
+#endif
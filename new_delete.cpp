@@ -0,0 +1,126 @@
+/*
+C++ operator new/delete on top of malloc.c, linked into libmalloc.so so that
+preloading the library also replaces the allocations made by C++ programs
+*/
+
+#include <cstddef>
+#include <new>
+
+extern "C" {
+void* malloc(std::size_t size);
+void free(void* block);
+void free_sized(void* block, std::size_t size);
+void free_aligned_sized(void* block, std::size_t alignment, std::size_t size);
+int posix_memalign(void** memptr, std::size_t alignment, std::size_t size);
+}
+
+// retry through the installed new_handler until it gives up by throwing
+static void* new_malloc(std::size_t size, std::size_t alignment) {
+    void* ptr;
+
+    for (;;) {
+        if (alignment > __STDCPP_DEFAULT_NEW_ALIGNMENT__) {
+            if (posix_memalign(&ptr, alignment, size) != 0) {
+                ptr = nullptr;
+            }
+        } else {
+            ptr = malloc(size);
+        }
+        if (ptr) {
+            return ptr;
+        }
+        std::new_handler handler = std::get_new_handler();
+        if (!handler) {
+            throw std::bad_alloc();
+        }
+        handler();
+    }
+}
+
+static void* new_malloc_nothrow(std::size_t size, std::size_t alignment) noexcept {
+    try {
+        return new_malloc(size, alignment);
+    } catch (...) {
+        return nullptr;
+    }
+}
+
+void* operator new(std::size_t size) {
+    return new_malloc(size, 0);
+}
+
+void* operator new[](std::size_t size) {
+    return new_malloc(size, 0);
+}
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept {
+    return new_malloc_nothrow(size, 0);
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept {
+    return new_malloc_nothrow(size, 0);
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment) {
+    return new_malloc(size, static_cast<std::size_t>(alignment));
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment) {
+    return new_malloc(size, static_cast<std::size_t>(alignment));
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    return new_malloc_nothrow(size, static_cast<std::size_t>(alignment));
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    return new_malloc_nothrow(size, static_cast<std::size_t>(alignment));
+}
+
+void operator delete(void* block) noexcept {
+    free(block);
+}
+
+void operator delete[](void* block) noexcept {
+    free(block);
+}
+
+void operator delete(void* block, const std::nothrow_t&) noexcept {
+    free(block);
+}
+
+void operator delete[](void* block, const std::nothrow_t&) noexcept {
+    free(block);
+}
+
+void operator delete(void* block, std::size_t size) noexcept {
+    free_sized(block, size);
+}
+
+void operator delete[](void* block, std::size_t size) noexcept {
+    free_sized(block, size);
+}
+
+void operator delete(void* block, std::align_val_t) noexcept {
+    free(block);
+}
+
+void operator delete[](void* block, std::align_val_t) noexcept {
+    free(block);
+}
+
+void operator delete(void* block, std::align_val_t, const std::nothrow_t&) noexcept {
+    free(block);
+}
+
+void operator delete[](void* block, std::align_val_t, const std::nothrow_t&) noexcept {
+    free(block);
+}
+
+void operator delete(void* block, std::size_t size, std::align_val_t alignment) noexcept {
+    free_aligned_sized(block, static_cast<std::size_t>(alignment), size);
+}
+
+void operator delete[](void* block, std::size_t size, std::align_val_t alignment) noexcept {
+    free_aligned_sized(block, static_cast<std::size_t>(alignment), size);
+}
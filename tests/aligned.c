@@ -0,0 +1,91 @@
+/*
+aligned_alloc, posix_memalign and memalign end like malloc: size 0 gets a
+unique pointer, failure sets errno, and recycled blocks can be freed again
+
+make test
+*/
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+
+static int failures;
+
+static void fail(const char* what, size_t alignment, size_t size) {
+    if (failures++ < 10) {
+        printf("aligned: %s, alignment %zu, size %zu\n", what, alignment, size);
+    }
+}
+
+static void check_zero(size_t alignment) {
+    void* a = aligned_alloc(alignment, 0), *b = aligned_alloc(alignment, 0), *p = NULL;
+
+    if (!a || !b || a == b || ((uintptr_t)a | (uintptr_t)b) & (alignment - 1)) {
+        fail("aligned_alloc of 0 bytes", alignment, 0);
+    }
+    if (posix_memalign(&p, alignment, 0) || !p || (uintptr_t)p & (alignment - 1)) {
+        fail("posix_memalign of 0 bytes", alignment, 0);
+    }
+    free(a);
+    free(b);
+    free(p);
+}
+
+static void check_failure(size_t alignment) {
+    void* p = &p;
+
+    errno = 0;
+    if (aligned_alloc(alignment, SIZE_MAX / 2) || errno != ENOMEM) {
+        fail("aligned_alloc failed without ENOMEM", alignment, SIZE_MAX / 2);
+    }
+    errno = 0;
+    if (memalign(alignment, SIZE_MAX - alignment) || errno != ENOMEM) {
+        fail("memalign failed without ENOMEM", alignment, SIZE_MAX - alignment);
+    }
+    errno = EINTR;
+    if (posix_memalign(&p, alignment, SIZE_MAX / 2) != ENOMEM || p != &p || errno != EINTR) {
+        fail("posix_memalign failure", alignment, SIZE_MAX / 2);
+    }
+}
+
+// blocks freed by free() come back through the aligned path, and freeing
+// them again must not look like a double free
+static void check_recycle(size_t alignment) {
+    void* blocks[64];
+    size_t size, i, round;
+
+    for (round = 0; round < 4; round++) {
+        for (i = 0; i < 64; i++) {
+            size = 16 + i * 200;
+            blocks[i] = i & 1 ? malloc(size) : aligned_alloc(alignment, size);
+            if (!blocks[i] || (!(i & 1) && (uintptr_t)blocks[i] & (alignment - 1))) {
+                fail("aligned_alloc", alignment, size);
+                continue;
+            }
+            memset(blocks[i], 0x5a, size);
+        }
+        for (i = 0; i < 64; i++) {
+            free(blocks[i]);
+        }
+    }
+}
+
+int main() {
+    size_t alignments[] = {32, 64, 256, 4096, 65536}, i;
+
+    for (i = 0; i < sizeof(alignments) / sizeof(alignments[0]); i++) {
+        check_zero(alignments[i]);
+        check_failure(alignments[i]);
+        check_recycle(alignments[i]);
+    }
+    if (failures) {
+        printf("aligned: %d failures\n", failures);
+        return 1;
+    }
+    printf("aligned: ok\n");
+    return 0;
+}
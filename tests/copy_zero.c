@@ -0,0 +1,129 @@
+/*
+realloc keeps every byte of malloc_usable_size() when it moves a block, and
+calloc hands out all-zero memory even when it recycles dirty blocks
+
+make test
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+
+int mallctl(const char* name, void* oldp, size_t* oldlenp, void* newp, size_t newlen);
+
+static int failures;
+
+static void fail(const char* what, size_t size, size_t at) {
+    if (failures++ < 10) {
+        printf("copy_zero: %s, size %zu, byte %zu\n", what, size, at);
+    }
+}
+
+static void check_realloc(size_t size, size_t new_size) {
+    unsigned char* block = malloc(size), *moved;
+    void* blocker;
+    size_t usable = malloc_usable_size(block), i;
+
+    for (i = 0; i < usable; i++) {
+        block[i] = (unsigned char)(i * 7 + 1);
+    }
+    blocker = malloc(64); // keep the block from growing in place
+    moved = realloc(block, new_size);
+    for (i = 0; i < usable && i < new_size; i++) {
+        if (moved[i] != (unsigned char)(i * 7 + 1)) {
+            fail("realloc lost data", size, i);
+            break;
+        }
+    }
+    free(moved);
+    free(blocker);
+}
+
+static void check_calloc(size_t size) {
+    unsigned char* dirty[8], *block;
+    size_t i, j;
+
+    for (i = 0; i < 8; i++) {
+        dirty[i] = malloc(size);
+        memset(dirty[i], 0xa5, malloc_usable_size(dirty[i]));
+    }
+    for (i = 0; i < 8; i++) {
+        free(dirty[i]);
+    }
+    for (i = 0; i < 8; i++) {
+        block = calloc(1, size);
+        for (j = 0; j < size; j++) {
+            if (block[j]) {
+                fail("calloc left a byte set", size, j);
+                break;
+            }
+        }
+        dirty[i] = block;
+    }
+    for (i = 0; i < 8; i++) {
+        free(dirty[i]);
+    }
+}
+
+// a dirty block of size shorter than 512 bytes freed at the top of the pool,
+// then calloc carving from there: only the part past the old top is zero
+static void check_calloc_top(size_t size) {
+    unsigned char* blocks[40], *block;
+    size_t i;
+
+    for (i = 0; i < 40; i++) {
+        blocks[i] = malloc(size);
+        memset(blocks[i], 0xa5, malloc_usable_size(blocks[i]));
+    }
+    // fill the cache and central list, so that the last one reaches the pool;
+    // every other one stays, so the free ones cannot coalesce and serve calloc
+    for (i = 0; i < 38; i += 2) {
+        free(blocks[i]);
+    }
+    free(blocks[39]);
+    block = calloc(1, 1000);
+    for (i = 0; i < 1000; i++) {
+        if (block[i]) {
+            fail("calloc left a byte set at the pool top", size, i);
+            break;
+        }
+    }
+    free(block);
+    for (i = 1; i < 39; i += 2) {
+        free(blocks[i]);
+    }
+    free(blocks[38]);
+}
+
+int main() {
+    uint64_t capacity = 2, bytes = 0, old_capacity, old_bytes;
+    size_t length = sizeof(uint64_t), size;
+
+    // first, while the pool top is still where the last malloc put it, and
+    // with one-block thread cache bins
+    mallctl("opt.tcache_capacity", &old_capacity, &length, &capacity, sizeof(capacity));
+    mallctl("opt.tcache_bytes", &old_bytes, &length, &bytes, sizeof(bytes));
+    for (size = 136; size <= 504; size += 16) {
+        check_calloc_top(size);
+    }
+    mallctl("opt.tcache_capacity", NULL, NULL, &old_capacity, sizeof(old_capacity));
+    mallctl("opt.tcache_bytes", NULL, NULL, &old_bytes, sizeof(old_bytes));
+
+    for (size = 1; size <= 5000; size += size < 1100 ? 1 : 37) {
+        check_realloc(size, size * 2 + 600);
+        check_calloc(size);
+    }
+    for (size = 100000; size <= 3000000; size = size * 3 / 2 + 8) {
+        check_realloc(size, size * 2);
+        check_calloc(size);
+    }
+    if (failures) {
+        printf("copy_zero: %d failures\n", failures);
+        return 1;
+    }
+    printf("copy_zero: ok\n");
+    return 0;
+}
@@ -0,0 +1,106 @@
+/*
+fork from a worker while other threads allocate, then start threads in the
+child, which glibc gives the dead threads' TLS, and make the scavenger walk
+the thread caches
+
+make test
+*/
+
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#define NUM_THREADS 8
+#define NUM_FORKS 20
+
+int mallctl(const char* name, void* oldp, size_t* oldlenp, void* newp, size_t newlen);
+
+static volatile int stop;
+
+// fill the caches of every size class, then keep them busy
+static void* churn(void* arg) {
+    void* blocks[256] = {0};
+    unsigned int seed = (unsigned int)(uintptr_t)arg, i;
+
+    do {
+        for (i = 0; i < 256; i++) {
+            seed = seed * 1103515245 + 12345;
+            free(blocks[i]);
+            blocks[i] = malloc((seed >> 16) % 512 + 1);
+            memset(blocks[i], (int)i, 1);
+        }
+    } while (!stop);
+    for (i = 0; i < 256; i++) {
+        free(blocks[i]);
+    }
+    return NULL;
+}
+
+static int child() {
+    pthread_t threads[NUM_THREADS];
+    uint64_t interval = 1;
+    int round, i;
+
+    alarm(10);
+    mallctl("opt.scavenge_interval_ms", NULL, NULL, &interval, sizeof(interval));
+    for (round = 0; round < 3; round++) {
+        stop = 0;
+        for (i = 0; i < NUM_THREADS; i++) {
+            pthread_create(&threads[i], NULL, churn, (void*)(uintptr_t)(i + 1));
+        }
+        usleep(20000);
+        malloc_trim(0);
+        stop = 1;
+        for (i = 0; i < NUM_THREADS; i++) {
+            pthread_join(threads[i], NULL);
+        }
+        malloc_trim(0);
+    }
+    return 0;
+}
+
+static void* forker(void* arg) {
+    int i, status, failed = 0;
+    pid_t pid;
+
+    (void)arg;
+    for (i = 0; i < NUM_FORKS; i++) {
+        usleep(1000);
+        if ((pid = fork()) == 0) {
+            _exit(child());
+        }
+        if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status)) {
+            failed++;
+        }
+    }
+    return (void*)(uintptr_t)failed;
+}
+
+int main() {
+    pthread_t threads[NUM_THREADS], thread;
+    void* failed;
+    int i;
+
+    for (i = 0; i < NUM_THREADS; i++) {
+        pthread_create(&threads[i], NULL, churn, (void*)(uintptr_t)(i + 1));
+    }
+    pthread_create(&thread, NULL, forker, NULL);
+    pthread_join(thread, &failed);
+    stop = 1;
+    for (i = 0; i < NUM_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    if (failed) {
+        printf("fork: %d of %d children failed or hung\n", (int)(uintptr_t)failed, NUM_FORKS);
+        return 1;
+    }
+    printf("fork: ok\n");
+    return 0;
+}
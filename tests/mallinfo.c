@@ -0,0 +1,83 @@
+/*
+glibc's mallinfo2, mallinfo, mallopt and malloc_info report on and set this
+allocator rather than glibc's unused one
+
+make test
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+
+int mallctl(const char* name, void* oldp, size_t* oldlenp, void* newp, size_t newlen);
+
+static int failures;
+
+static void fail(const char* what) {
+    failures++;
+    printf("mallinfo: %s\n", what);
+}
+
+int main() {
+    void* volatile blocks[100];
+    struct mallinfo2 before, after;
+    struct mallinfo old;
+    uint64_t threshold = 0;
+    size_t len = sizeof(threshold), i;
+    char* xml = NULL;
+    FILE* stream;
+
+    before = mallinfo2();
+    for (i = 0; i < 100; i++) {
+        blocks[i] = malloc(10000);
+    }
+    blocks[0] = realloc(blocks[0], 8 << 20);
+    after = mallinfo2();
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wdeprecated-declarations"
+    old = mallinfo();
+#pragma GCC diagnostic pop
+    // mapped blocks count as their mapping less its header, within a page
+    if (after.uordblks + 4096 < before.uordblks + 99 * 10000 || after.uordblks > before.uordblks + 99 * 10400) {
+        fail("uordblks does not count the live blocks");
+    }
+    if (after.hblkhd < before.hblkhd + (8 << 20)) {
+        fail("hblkhd does not count the mapped block");
+    }
+    if (after.arena < after.uordblks || after.fordblks != after.arena - after.uordblks) {
+        fail("arena is not uordblks and fordblks");
+    }
+    if ((size_t)old.uordblks != after.uordblks || (size_t)old.arena != after.arena) {
+        fail("mallinfo differs from mallinfo2");
+    }
+    for (i = 0; i < 100; i++) {
+        free(blocks[i]);
+    }
+
+    if (mallopt(M_MMAP_THRESHOLD, 1 << 20) != 1
+        || mallctl("opt.mmap_threshold", &threshold, &len, NULL, 0) || threshold != 1 << 20) {
+        fail("mallopt(M_MMAP_THRESHOLD) not applied");
+    }
+    if (mallopt(M_MMAP_THRESHOLD, -1) || mallopt(M_TOP_PAD, 4096) || mallopt(M_PERTURB, 1)) {
+        fail("mallopt accepts what it does not handle");
+    }
+
+    stream = open_memstream(&xml, &len);
+    if (malloc_info(0, stream) || fclose(stream) || !strstr(xml, "<malloc version=\"1\">")) {
+        fail("malloc_info wrote no XML");
+    }
+    free(xml);
+    if (malloc_info(1, stdout) != -1) {
+        fail("malloc_info accepts options");
+    }
+
+    if (failures) {
+        printf("mallinfo: %d failures\n", failures);
+        return 1;
+    }
+    printf("mallinfo: ok\n");
+    return 0;
+}
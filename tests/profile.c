@@ -0,0 +1,87 @@
+/*
+a profile signal is dumped by the next malloc rather than the next sample,
+and a mapped block keeps its sample when realloc moves it
+
+make test
+*/
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+void malloc_set_profile_rate(size_t rate);
+int malloc_profile_signal(int signo, const char* path);
+int malloc_profile_dump(const char* path);
+
+static int failures;
+
+static void fail(const char* what) {
+    failures++;
+    printf("profile: %s\n", what);
+}
+
+// whether the profile at path has a sample of size bytes
+static int has_sample(const char* path, size_t size) {
+    char line[4096], want[64];
+    FILE* file = fopen(path, "r");
+    int found = 0;
+
+    if (!file) {
+        return 0;
+    }
+    snprintf(want, sizeof(want), "1: %zu [", size);
+    while (!found && fgets(line, sizeof(line), file)) {
+        found = !strncmp(line, want, strlen(want));
+    }
+    fclose(file);
+    return found;
+}
+
+int main() {
+    char path[64];
+    void* volatile block;
+
+    snprintf(path, sizeof(path), "/tmp/malloc-profile-test.%d", (int)getpid());
+    unlink(path);
+
+    // every allocation sampled; the first one of a thread only starts its countdown
+    malloc_set_profile_rate(1);
+    block = malloc(16);
+    free(block);
+    block = malloc(1000000);
+    block = realloc(block, 64000000);
+    memset(block, 1, 64000000);
+    if (malloc_profile_dump(path) || !has_sample(path, 1000000)) {
+        fail("sample of a moved block lost");
+    }
+    free(block);
+    if (malloc_profile_dump(path) || has_sample(path, 1000000)) {
+        fail("sample kept after free");
+    }
+    unlink(path);
+
+    // with sampling off, the signal is still served
+    malloc_set_profile_rate(0);
+    if (malloc_profile_signal(SIGUSR1, path)) {
+        fail("malloc_profile_signal failed");
+    }
+    raise(SIGUSR1);
+    if (!access(path, F_OK)) {
+        fail("dumped in the signal handler");
+    }
+    block = malloc(16);
+    free(block);
+    if (access(path, F_OK)) {
+        fail("no dump after the next malloc");
+    }
+    unlink(path);
+
+    if (failures) {
+        printf("profile: %d failures\n", failures);
+        return 1;
+    }
+    printf("profile: ok\n");
+    return 0;
+}
@@ -0,0 +1,130 @@
+/*
+the bytes the class statistics count as allocated and freed balance: after
+every block of a malloc, realloc and free cycle is freed again, allocated
+less freed is back where it started, and a live block counts as its size
+
+make test
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+
+int mallctl(const char* name, void* oldp, size_t* oldlenp, void* newp, size_t newlen);
+void free_sized(void* block, size_t size);
+size_t malloc_batch(size_t size, size_t num, void** ptrs);
+void free_batch(size_t num, void** ptrs);
+
+static int failures;
+
+static uint64_t stat(const char* name) {
+    uint64_t value = 0;
+    size_t len = sizeof(value);
+
+    mallctl(name, &value, &len, NULL, 0);
+    return value;
+}
+
+// allocated less freed bytes over every class
+static int64_t live_bytes() {
+    char name[64];
+    uint64_t classes = stat("stats.classes"), i;
+    int64_t live = 0;
+
+    for (i = 0; i < classes; i++) {
+        snprintf(name, sizeof(name), "stats.classes.%llu.bytes_allocated", (unsigned long long)i);
+        live += (int64_t)stat(name);
+        snprintf(name, sizeof(name), "stats.classes.%llu.bytes_freed", (unsigned long long)i);
+        live -= (int64_t)stat(name);
+    }
+    return live;
+}
+
+static void check(const char* what, int64_t before, int64_t expected) {
+    int64_t live = live_bytes() - before;
+
+    if (live != expected && failures++ < 10) {
+        printf("stats: %s, %lld live bytes, expected %lld\n", what, (long long)live, (long long)expected);
+    }
+}
+
+int main() {
+    void* volatile blocks[64];
+    void* batch[16];
+    size_t sizes[] = {24, 200, 496, 512, 600, 3000, 70000, 200000, 600000, 5000000}, i, j;
+    int64_t before;
+
+    before = live_bytes();
+    for (i = 0; i < 10; i++) {
+        blocks[0] = malloc(200000);
+        free(blocks[0]);
+    }
+    check("malloc and free", before, 0);
+
+    before = live_bytes();
+    for (i = 0; i < 10; i++) {
+        blocks[0] = malloc(600);
+        blocks[0] = realloc(blocks[0], 3000);
+        free(blocks[0]);
+    }
+    check("realloc in place", before, 0);
+
+    // each size grown and shrunk through every other, in the pool and mapped
+    before = live_bytes();
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        blocks[i] = malloc(sizes[i]);
+        for (j = 0; j < sizeof(sizes) / sizeof(sizes[0]); j++) {
+            blocks[i] = realloc(blocks[i], sizes[j]);
+            memset(blocks[i], 1, sizes[j]);
+        }
+        blocks[i] = realloc(blocks[i], sizes[i]);
+    }
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        if (i & 1) {
+            free_sized(blocks[i], sizes[i]);
+        } else {
+            free(blocks[i]);
+        }
+    }
+    check("realloc through every size", before, 0);
+
+    // blocks that fragment the pool, so that some come with slack
+    before = live_bytes();
+    for (j = 0; j < 8; j++) {
+        for (i = 0; i < 64; i++) {
+            blocks[i] = malloc(136 + (i * 7 + j * 13) % 400);
+        }
+        for (i = 0; i < 64; i += 2) {
+            free(blocks[i]);
+        }
+        for (i = 0; i < 64; i += 2) {
+            blocks[i] = malloc(512 - (i * 3 + j) % 64);
+        }
+        for (i = 0; i < 64; i++) {
+            free(blocks[i]);
+        }
+    }
+    check("fragmented pool", before, 0);
+
+    before = live_bytes();
+    for (i = 0; i < 4; i++) {
+        j = malloc_batch(300, 16, batch);
+        free_batch(j, batch);
+    }
+    check("malloc_batch", before, 0);
+
+    before = live_bytes();
+    blocks[0] = malloc(100000);
+    check("one live block", before, (int64_t)(malloc_usable_size(blocks[0]) & ~(size_t)15));
+    free(blocks[0]);
+
+    if (failures) {
+        printf("stats: %d failures\n", failures);
+        return 1;
+    }
+    printf("stats: ok\n");
+    return 0;
+}
@@ -0,0 +1,79 @@
+/*
+malloc_trim gives back the blocks every cache holds, the thread caches and,
+in builds with PERCPU_CACHES=1, the per-CPU ones of every CPU
+
+make test
+make clean test CFLAGS="-O2 -g -DPERCPU_CACHES=1"
+*/
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <malloc.h>
+
+#define BLOCKS 64
+
+int mallctl(const char* name, void* oldp, size_t* oldlenp, void* newp, size_t newlen);
+
+static uint64_t stat(const char* name) {
+    uint64_t value = 0;
+    size_t len = sizeof(value);
+
+    mallctl(name, &value, &len, NULL, 0);
+    return value;
+}
+
+// pool memory carved out and not on its free lists, which counts cached blocks
+static uint64_t in_use() {
+    return stat("stats.allocated") - stat("stats.free");
+}
+
+// leave freed blocks of every cached size in the caches of the CPU run on
+static void* churn(void* arg) {
+    void* volatile blocks[BLOCKS];
+    cpu_set_t one;
+    size_t size, i;
+
+    CPU_ZERO(&one);
+    CPU_SET((int)(intptr_t)arg, &one);
+    sched_setaffinity(0, sizeof(one), &one);
+    for (size = 144; size <= 512; size += 16) {
+        for (i = 0; i < BLOCKS; i++) {
+            blocks[i] = malloc(size);
+        }
+        for (i = 0; i < BLOCKS; i++) {
+            free(blocks[i]);
+        }
+    }
+    return NULL;
+}
+
+int main() {
+    pthread_t threads[8];
+    int cpus = sysconf(_SC_NPROCESSORS_ONLN), i, n = cpus < 8 ? cpus : 8;
+    uint64_t before, cached;
+
+    malloc_trim(0);
+    before = in_use();
+    for (i = 0; i < n; i++) {
+        pthread_create(&threads[i], NULL, churn, (void*)(intptr_t)i);
+    }
+    // the main thread, whose cache the scavenger leaves alone, too
+    churn((void*)(intptr_t)0);
+    for (i = 0; i < n; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    cached = in_use();
+    malloc_trim(0);
+    if (in_use() > before + (cached - before) / 64) {
+        printf("trim: %llu bytes still in use of %llu cached\n",
+               (unsigned long long)(in_use() - before), (unsigned long long)(cached - before));
+        return 1;
+    }
+    printf("trim: ok\n");
+    return 0;
+}